@@ -20,14 +20,18 @@
 // http://users.phg-online.de/tk/netatalk/doc/Apple/v1/AppleSingle_AppleDouble_v1.pdf
 
 #define kAppleDoubleMagic               0x00051607
+#define kAppleSingleMagic               0x00051600
 #define kAppleDoubleVersion             0x00020000
+#define kAppleDoubleDataForkEntry       1
 #define kAppleDoubleResourceForkEntry   2
 #define kAppleDoubleRealNameEntry       3
 #define kAppleDoubleCommentEntry        4
 #define kAppleDoubleIconEntry           5
 #define kAppleDoubleColorIconEntry      6
 #define kAppleDoubleFileInfoEntry       7
+#define kAppleDoubleFileDatesEntry      8
 #define kAppleDoubleFinderInfoEntry     9
+#define kAppleDoubleDateDelta           946684800   // 2000-01-01, origin of file dates
 
 struct __attribute__ ((__packed__)) AppleDoubleEntry {
     uint32_t    type;
@@ -44,6 +48,14 @@ struct __attribute__ ((__packed__)) AppleDoubleMacFileInfo {
 };
 typedef struct AppleDoubleMacFileInfo AppleDoubleMacFileInfo;
 
+struct __attribute__ ((__packed__)) AppleDoubleFileDates {
+    int32_t     creationDate;   // seconds since kAppleDoubleDateDelta
+    int32_t     modificationDate;
+    int32_t     backupDate;
+    int32_t     accessDate;
+};
+typedef struct AppleDoubleFileDates AppleDoubleFileDates;
+
 struct __attribute__  ((__packed__)) AppleDouble {
     uint32_t            magic;
     uint32_t            version;
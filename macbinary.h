@@ -0,0 +1,57 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// http://files.stairways.com/other/macbinaryiii-standard-info.txt
+
+#define kMacBinaryHeaderLength          128
+#define kMacBinaryPadding               128     // forks are padded to this
+#define kMacBinarySignature             'mBIN'
+#define kMacBinaryVersion               130     // MacBinary III
+#define kMacBinaryMinVersion            129     // readable as MacBinary II
+
+struct __attribute__ ((__packed__)) MacBinaryHeader {
+    uint8_t     oldVersion;     // 0
+    uint8_t     nameLength;     // 1-63
+    char        name[63];       // MacRoman
+    uint32_t    type;
+    uint32_t    creator;
+    uint8_t     flagsHigh;      // finder flags, bits 8-15
+    uint8_t     zero1;
+    int16_t     locV, locH;     // icon position
+    int16_t     folder;         // window or folder ID
+    uint8_t     locked;         // protected flag
+    uint8_t     zero2;
+    uint32_t    dataLength;
+    uint32_t    rsrcLength;
+    uint32_t    creationDate;
+    uint32_t    modificationDate;
+    uint16_t    commentLength;  // Get Info comment, follows resource fork
+    uint8_t     flagsLow;       // finder flags, bits 0-7
+    uint32_t    signature;      // 'mBIN'
+    uint8_t     script;         // of file name
+    uint8_t     extendedFlags;
+    char        _rsv[8];
+    uint32_t    unpackedLength; // for compressed files
+    uint16_t    secondaryHeaderLength;
+    uint8_t     version;        // version used to write this
+    uint8_t     minVersion;     // version needed to read this
+    uint16_t    crc;            // CRC-16/XMODEM of bytes 0-123
+    uint16_t    _rsv2;
+};
+typedef struct MacBinaryHeader MacBinaryHeader;
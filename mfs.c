@@ -17,6 +17,10 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+// pread, posix_fadvise, posix_madvise and strsep aren't in C99, and the
+// source hooks silently do nothing without them
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -25,10 +29,16 @@
 #include <strings.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
 #include "mfs.h"
-#if defined(USE_LIBRES)
+#include "mfs_private.h"
+#include "macbinary.h"
 #include "fobj.h"
-#endif
+
+// read ahead window for sequential forks
+#define kMFSReadAhead   (256*1024)
 
 const char * libmfs_id = "libmfs 1.0.2 (C)2008-2010 namedfork.net";
 
@@ -36,39 +46,78 @@ const char * libmfs_id = "libmfs 1.0.2 (C)2008-2010 namedfork.net";
 #define BINFLG8(x) ((x)&0x80?'1':'0'),((x)&0x40?'1':'0'),((x)&0x20?'1':'0'),((x)&0x10?'1':'0'),((x)&0x08?'1':'0'),((x)&0x04?'1':'0'),((x)&0x02?'1':'0'),((x)&0x01?'1':'0')
 #define BINFLG16(x) BINFLG8((x>>8)), BINFLG8(x)
 
-// private functions
-int mfs_blkread (MFSVolume *vol, size_t numBlocks, size_t offset, void *buf);
-int mfs_albkread (MFSVolume *vol, size_t numBlocks, uint16_t start, void *buf);
-int mfs_fkread_at_appledouble (MFSFork *fk, size_t size, size_t offset, void *buf);
-int mfs_fkread_at_real (MFSFork *fk, size_t size, size_t offset, void *buf);
-MFSVABM mfs_vabm (MFSVolume *vol);
-MFSDirectoryRecord* mfs_directory_record (MFSDirectoryRecord *src, size_t size);
-int16_t mfs_comment_id (const char *flCName);
-int16_t mfs_folder_id (MFSDirectoryRecord *rec);
-#ifdef USE_LIBRES
-RFILE * mfs_desktop (MFSVolume *vol);
-#endif
-int mfs_load_folders (MFSVolume *vol);
-int mfs_fneq (const uint8_t *s1, const uint8_t *s2);
-#if defined(LIBMFS_VERBOSE)
-int mfs_printmdb (MFSMasterDirectoryBlock *mdb);
-int mfs_printrecord (MFSDirectoryRecord *rec);
-#endif
-
 MFSVolume* mfs_vopen (const char *path, size_t offset, int flags) {
-    FILE* fp = fopen(path, "r");
-    if (fp == NULL) return NULL;
-    MFSVolume* vol = malloc(sizeof(MFSVolume));
-    bzero(vol, sizeof(MFSVolume));
-    vol->fp = fp;
+    return mfs_vopen_alloc(path, offset, flags, NULL);
+}
+
+// alloc is copied, NULL uses malloc
+MFSVolume* mfs_vopen_alloc (const char *path, size_t offset, int flags, const MFSAllocator *alloc) {
+    MFSBlockSource src;
+    struct stat st;
+    if (alloc && (alloc->alloc == NULL || alloc->free == NULL)) {errno = EINVAL; return NULL;}
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    if (-1 == fstat(fd, &st) || -1 == mfs_source_fd(&src, fd, 1, alloc)) {
+        close(fd);
+        return NULL;
+    }
+    
+    // sidecar index goes next to the image
+    char *indexPath = NULL;
+    if (flags & MFS_INDEX) {
+        indexPath = malloc(strlen(path) + sizeof(kMFSIndexSuffix));
+        if (indexPath) sprintf(indexPath, "%s%s", path, kMFSIndexSuffix);
+    }
+    
+    MFSVolume *vol = mfs_vopen_internal(&src, offset, flags, indexPath, st.st_mtime, alloc);
+    if (vol == NULL) src.close(src.ctx);
+    free(indexPath);
+    return vol;
+}
+
+MFSVolume* mfs_vopen_fd (int fd, size_t offset, int flags) {
+    MFSBlockSource src;
+    struct stat st;
+    if (-1 == fstat(fd, &st) || -1 == mfs_source_fd(&src, fd, 0, NULL)) return NULL;
+    MFSVolume *vol = mfs_vopen_internal(&src, offset, flags, NULL, st.st_mtime, NULL);
+    if (vol == NULL) src.close(src.ctx);
+    return vol;
+}
+
+MFSVolume* mfs_vopen_mem (const void *data, size_t size, size_t offset, int flags) {
+    MFSBlockSource src;
+    if (-1 == mfs_source_mem(&src, data, size, NULL)) return NULL;
+    MFSVolume *vol = mfs_vopen_internal(&src, offset, flags, NULL, 0, NULL);
+    if (vol == NULL) src.close(src.ctx);
+    return vol;
+}
+
+MFSVolume* mfs_vopen_source (const MFSBlockSource *src, size_t offset, int flags, const MFSAllocator *alloc) {
+    if (src == NULL || src->read_at == NULL) {errno = EINVAL; return NULL;}
+    if (alloc && (alloc->alloc == NULL || alloc->free == NULL)) {errno = EINVAL; return NULL;}
+    return mfs_vopen_internal(src, offset, flags, NULL, 0, alloc);
+}
+
+// the source is owned by the volume if it opens, and left alone otherwise
+MFSVolume* mfs_vopen_internal (const MFSBlockSource *src, size_t offset, int flags, const char *indexPath, time_t mtime, const MFSAllocator *alloc) {
+    // the volume is the first thing in its own arena
+    MFSVolume boot;
+    bzero(&boot, sizeof(MFSVolume));
+    boot.alloc = alloc? *alloc : mfs_allocator_default;
+    MFSVolume* vol = mfs_arena_alloc(&boot, sizeof(MFSVolume));
+    if (vol == NULL) return NULL;
+    *vol = boot;
+    vol->src = *src;
+    pthread_mutex_init(&vol->lock, NULL);
     vol->offset = offset;
     vol->openForks = 0;
+    vol->flags = flags;
+    vol->mtime = mtime;
     
     // read MDB
-    void* mdb_block = malloc(kMFSBlockSize);
+    MFSBlock mdb_block;
     if (-1 == mfs_blkread(vol, 1, 2, mdb_block)) goto error;
     memcpy(&vol->mdb, mdb_block, sizeof(MFSMasterDirectoryBlock));
-    free(mdb_block);
     // bring to host endianness
     MFSMasterDirectoryBlock *mdb = &vol->mdb;
     mdb->drSigWord  = ntohs(mdb->drSigWord);
@@ -85,6 +134,7 @@ MFSVolume* mfs_vopen (const char *path, size_t offset, int flags) {
     mdb->drNxtFNum  = ntohl(mdb->drNxtFNum);
     mdb->drFreeBks  = ntohs(mdb->drFreeBks);
     strncpy(vol->name, (char*)&mdb->drVN[1], mdb->drVN[0]);
+    mfs_utf8_from_macroman(vol->uname, sizeof vol->uname, vol->name);
     
     // check MDB
     if (mdb->drSigWord != kMFSSignature) goto error;
@@ -92,17 +142,29 @@ MFSVolume* mfs_vopen (const char *path, size_t offset, int flags) {
     mfs_printmdb(mdb);
     #endif
     
+    vol->alBkOff = mdb->drAlBlSt*kMFSBlockSize - 2*mdb->drAlBlkSiz;
+    
+    // use sidecar index if it's up to date
+    if (indexPath && mfs_index_load(vol, indexPath, flags) == 0) {
+        if (-1 == mfs_columns_build(vol)) goto fail;
+        return vol;
+    }
+    
     // read volume allocation block map
     vol->vabm = mfs_vabm(vol);
-    vol->alBkOff = mdb->drAlBlSt*kMFSBlockSize - 2*mdb->drAlBlkSiz;
+    if (vol->vabm == NULL) goto fail;
     
     // read directory
-    vol->directory = mfs_directory(vol);
+    vol->directory = mfs_directory_read(vol, 1);
+    if (vol->directory == NULL) goto fail;
+    if (-1 == mfs_name_hash_build(vol)) goto fail;
+    if (-1 == mfs_columns_build(vol)) goto fail;
     
     // read tree
-    #if defined(USE_LIBRES)
-    if (flags & MFS_FOLDERS) mfs_load_folders(vol);
-    #endif
+    if ((flags & MFS_FOLDERS) && -1 == mfs_load_folders(vol)) goto fail;
+    
+    // save index for next time, failing to do so is not an error
+    if (indexPath) mfs_index_write(vol, indexPath);
     
     return vol;
 error:
@@ -111,38 +173,205 @@ error:
 #else
     errno = EINVAL;
 #endif
-    free(vol);
+fail:
+    // errno is left as whatever failed set it
+    if (vol->index) munmap(vol->index, vol->indexLen);
+    if (vol->desktop) {
+        __sync_fetch_and_add(&vol->openForks, 1);
+        mfs_res_close(vol->desktop);
+    }
+    if (vol->desktopFork) {
+        __sync_fetch_and_add(&vol->openForks, 1);
+        mfs_fkclose(vol->desktopFork);
+    }
+    pthread_mutex_destroy(&vol->lock);
+    mfs_arena_release(vol);
     return NULL;
 }
 
 int mfs_vclose (MFSVolume* vol) {
-    if (vol->openForks) {
+    if (__sync_add_and_fetch(&vol->openForks, 0)) {
         errno = EBUSY;
         return -1;
     }
-    mfs_directory_free(vol->directory);
-    free(vol->vabm);
-    fclose(vol->fp);
-#ifdef USE_LIBRES
-    if (vol->desktop) res_close(vol->desktop);
-    if (vol->folders) free(vol->folders);
+    // vabm, folders and name hash live in the index mapping, if there is one
+    if (vol->index) munmap(vol->index, vol->indexLen);
+    if (vol->src.close) vol->src.close(vol->src.ctx);
+    if (vol->desktop) {
+        // the Desktop fork doesn't count as open
+        __sync_fetch_and_add(&vol->openForks, 1);
+        mfs_res_close(vol->desktop);
+    }
+    if (vol->desktopFork) {
+        __sync_fetch_and_add(&vol->openForks, 1);
+        mfs_fkclose(vol->desktopFork);
+    }
+    pthread_mutex_destroy(&vol->lock);
+    // directory, hashes, columns and the volume itself
+    mfs_arena_release(vol);
+    return 0;
+}
+
+// block source for file descriptors
+struct MFSFileSource {
+    int             fd;
+    int             owned;  // close fd with the source
+    MFSAllocator    alloc;  // the source came from it
+};
+
+ssize_t mfs_fd_read_at (void *ctx, void *buf, size_t size, uint64_t offset) {
+    return pread(((struct MFSFileSource*)ctx)->fd, buf, size, (off_t)offset);
+}
+
+uint64_t mfs_fd_size (void *ctx) {
+    struct stat st;
+    if (-1 == fstat(((struct MFSFileSource*)ctx)->fd, &st)) return 0;
+    return st.st_size;
+}
+
+void mfs_fd_prefetch (void *ctx, uint64_t offset, size_t size) {
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(((struct MFSFileSource*)ctx)->fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory ra = {(off_t)offset, (int)size};
+    fcntl(((struct MFSFileSource*)ctx)->fd, F_RDADVISE, &ra);
 #endif
-    free(vol);
+}
+
+void mfs_fd_advise (void *ctx, uint64_t offset, size_t size, int advice) {
+#if defined(POSIX_FADV_NORMAL)
+    static const int fadvice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+    posix_fadvise(((struct MFSFileSource*)ctx)->fd, (off_t)offset, (off_t)size, fadvice[advice]);
+#else
+    // F_RDAHEAD and F_NOCACHE would change reads of the whole file
+    if (advice == kMFSAdviseWillNeed) mfs_fd_prefetch(ctx, offset, size);
+#endif
+}
+
+int mfs_fd_fileno (void *ctx) {
+    return ((struct MFSFileSource*)ctx)->fd;
+}
+
+void mfs_fd_close (void *ctx) {
+    struct MFSFileSource *fs = ctx;
+    MFSAllocator alloc = fs->alloc;
+    if (fs->owned) close(fs->fd);
+    alloc.free(alloc.ctx, fs, sizeof(struct MFSFileSource));
+}
+
+// alloc should be the one the volume will be opened with, NULL uses malloc
+int mfs_source_fd (MFSBlockSource *src, int fd, int owned, const MFSAllocator *alloc) {
+    if (alloc == NULL) alloc = &mfs_allocator_default;
+    struct MFSFileSource *fs = alloc->alloc(alloc->ctx, sizeof(struct MFSFileSource));
+    if (fs == NULL) return -1;
+    fs->fd = fd;
+    fs->owned = owned;
+    fs->alloc = *alloc;
+    src->ctx = fs;
+    src->read_at = mfs_fd_read_at;
+    src->size = mfs_fd_size;
+    src->prefetch = mfs_fd_prefetch;
+    src->fileno = mfs_fd_fileno;
+    src->close = mfs_fd_close;
+    src->base = NULL;
+    src->advise = mfs_fd_advise;
     return 0;
 }
 
-int mfs_blkread (MFSVolume *vol, size_t numBlocks, size_t offset, void *buf) {
-    if (-1 == fseek(vol->fp, vol->offset+(kMFSBlockSize*offset), SEEK_SET)) return -1;
-    if (numBlocks != fread(buf, kMFSBlockSize, numBlocks, vol->fp)) return -1;
+// block source for images in memory
+struct MFSMemSource {
+    const uint8_t   *data;
+    size_t          size;
+    MFSAllocator    alloc;
+};
+
+ssize_t mfs_mem_read_at (void *ctx, void *buf, size_t size, uint64_t offset) {
+    struct MFSMemSource *ms = ctx;
+    if (offset >= ms->size) return 0;
+    if (offset + size > ms->size) size = ms->size - offset;
+    memcpy(buf, ms->data + offset, size);
+    return size;
+}
+
+uint64_t mfs_mem_size (void *ctx) {
+    return ((struct MFSMemSource*)ctx)->size;
+}
+
+void mfs_mem_advise (void *ctx, uint64_t offset, size_t size, int advice) {
+#if defined(POSIX_MADV_NORMAL)
+    static const int madvice[] = {POSIX_MADV_NORMAL, POSIX_MADV_SEQUENTIAL, POSIX_MADV_RANDOM, POSIX_MADV_WILLNEED, POSIX_MADV_DONTNEED};
+    struct MFSMemSource *ms = ctx;
+    if (offset >= ms->size) return;
+    if (offset + size > ms->size) size = ms->size - offset;
+    // only does something if the image is mapped, errors don't matter
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(ms->data + offset) & ~(page-1);
+    uintptr_t end = (uintptr_t)(ms->data + offset + size);
+    posix_madvise((void*)start, end - start, madvice[advice]);
+#endif
+}
+
+void mfs_mem_close (void *ctx) {
+    struct MFSMemSource *ms = ctx;
+    MFSAllocator alloc = ms->alloc;
+    alloc.free(alloc.ctx, ms, sizeof(struct MFSMemSource));
+}
+
+int mfs_source_mem (MFSBlockSource *src, const void *data, size_t size, const MFSAllocator *alloc) {
+    if (alloc == NULL) alloc = &mfs_allocator_default;
+    struct MFSMemSource *ms = alloc->alloc(alloc->ctx, sizeof(struct MFSMemSource));
+    if (ms == NULL) return -1;
+    ms->data = data;
+    ms->size = size;
+    ms->alloc = *alloc;
+    src->ctx = ms;
+    src->read_at = mfs_mem_read_at;
+    src->size = mfs_mem_size;
+    src->prefetch = NULL;
+    src->fileno = NULL;
+    src->close = mfs_mem_close;
+    src->base = data;
+    src->advise = mfs_mem_advise;
     return 0;
 }
 
-int mfs_albkread (MFSVolume *vol, size_t numBlocks, uint16_t start, void *buf) {
-    if (-1 == fseek(vol->fp, (vol->offset)+(vol->alBkOff)+(vol->mdb.drAlBlkSiz*start), SEEK_SET)) return -1;
-    if (numBlocks != fread(buf, vol->mdb.drAlBlkSiz, numBlocks, vol->fp)) return -1;
+// positional read relative to the start of the volume, doesn't share a file position
+// between threads. returns 0 if all bytes were read, -1 otherwise
+int mfs_read_at (MFSVolume *vol, void *buf, size_t size, off_t offset) {
+    ssize_t rb;
+    offset += vol->offset;
+    while (size) {
+        rb = vol->src.read_at(vol->src.ctx, buf, size, offset);
+        if (rb == -1 && errno == EINTR) continue;
+        if (rb <= 0) {
+            if (rb == 0) errno = EIO;
+            return -1;
+        }
+        buf += rb;
+        size -= rb;
+        offset += rb;
+    }
     return 0;
 }
 
+// hint that a range of the volume will be read soon
+void mfs_prefetch (MFSVolume *vol, size_t size, off_t offset) {
+    if (vol->src.prefetch) vol->src.prefetch(vol->src.ctx, vol->offset + offset, size);
+}
+
+void mfs_advise (MFSVolume *vol, size_t size, off_t offset, int advice) {
+    if (vol->src.advise) vol->src.advise(vol->src.ctx, vol->offset + offset, size, advice);
+    else if (advice == kMFSAdviseWillNeed) mfs_prefetch(vol, size, offset);
+}
+
+int mfs_blkread (MFSVolume *vol, size_t numBlocks, size_t offset, void *buf) {
+    return mfs_read_at(vol, buf, kMFSBlockSize*numBlocks, (off_t)kMFSBlockSize*offset);
+}
+
+int mfs_albkread (MFSVolume *vol, size_t numBlocks, uint16_t start, void *buf) {
+    return mfs_read_at(vol, buf, vol->mdb.drAlBlkSiz*numBlocks, (off_t)vol->alBkOff + (off_t)vol->mdb.drAlBlkSiz*start);
+}
+
 time_t mfs_time (uint32_t mfsDate) {
     return mfsDate - kMFSTimeDelta;
 }
@@ -220,12 +449,16 @@ MFSVABM mfs_vabm (MFSVolume *vol) {
     size_t vabm_size = (mdb->drNmAlBlks*3)/2;
     size_t vabm_span = vabm_size + sizeof(MFSMasterDirectoryBlock);
     size_t vabm_blks = vabm_span/kMFSBlockSize + (vabm_span%kMFSBlockSize?1:0);
-    void* vabm_bits = malloc(vabm_blks*kMFSBlockSize);
-    if (-1 == mfs_blkread(vol, vabm_blks, 2, vabm_bits)) return NULL;
+    void* vabm_bits = mfs_malloc(vol, vabm_blks*kMFSBlockSize);
+    if (vabm_bits == NULL) return NULL;
+    MFSVABM vabm = mfs_arena_alloc(vol, sizeof(uint16_t)*(mdb->drNmAlBlks+2));
+    if (vabm == NULL || -1 == mfs_blkread(vol, vabm_blks, 2, vabm_bits)) {
+        mfs_free(vol, vabm_bits);
+        return NULL;
+    }
     
     // parse VABM
     void* vabm_base = vabm_bits + sizeof(MFSMasterDirectoryBlock);
-    MFSVABM vabm = malloc(sizeof(uint16_t)*(mdb->drNmAlBlks+2));
     vabm[0] = mdb->drNmAlBlks;
     vabm[1] = 0x1337;
     
@@ -238,19 +471,33 @@ MFSVABM mfs_vabm (MFSVolume *vol) {
         else vabm[n] = (val & 0xFFF0) >> 4;
     }
     
+    mfs_free(vol, vabm_bits);
     return vabm;
 }
 
 // read directory
-MFSDirectoryRecord ** mfs_directory (MFSVolume *vol) {
+// the volume's own copy is in its arena, copies for callers can be freed
+// with mfs_directory_free and remember their volume before the array
+MFSDirectoryRecord ** mfs_directory_read (MFSVolume *vol, int arena) {
     MFSMasterDirectoryBlock *mdb = &vol->mdb;
-    MFSBlock *dir_blk = calloc(mdb->drBlLen, kMFSBlockSize);
-    // array of pointers to records
-    MFSDirectoryRecord ** dir = calloc(mdb->drNmFls+1, sizeof(MFSDirectoryRecord*));
+    MFSBlock *dir_blk = mfs_calloc(vol, mdb->drBlLen, kMFSBlockSize);
+    // array of pointers to records, followed by the records themselves
+    // records can't be bigger than the directory, plus a null terminator each,
+    // and the UTF-8 name after each is at most 3 times as long as the MacRoman one
+    size_t dir_ptrs = sizeof(MFSDirectoryRecord*)*(mdb->drNmFls+1);
+    size_t dir_size = dir_ptrs + 4*mdb->drBlLen*kMFSBlockSize + 2*mdb->drNmFls;
+    MFSDirectoryRecord ** dir;
+    if (arena) dir = mfs_arena_alloc(vol, dir_size);
+    else if ((dir = mfs_calloc(vol, 1, sizeof(MFSVolume*) + dir_size))) {
+        *(MFSVolume**)dir = vol;
+        dir = (void*)dir + sizeof(MFSVolume*);
+    }
+    if (dir_blk == NULL || dir == NULL) goto error;
+    uint8_t *arena_pos = (uint8_t*)dir + dir_ptrs;
     dir[mdb->drNmFls] = NULL;
     
     // read directory blocks
-    mfs_blkread(vol, mdb->drBlLen, mdb->drDirSt, dir_blk);
+    if (-1 == mfs_blkread(vol, mdb->drBlLen, mdb->drDirSt, dir_blk)) goto error;
     
     // parse
     MFSDirectoryRecord *rec;
@@ -259,12 +506,14 @@ MFSDirectoryRecord ** mfs_directory (MFSVolume *vol) {
     for(block = 0; block < mdb->drBlLen; block++) {
         // read records in a block
         rec_offset = 0;
-        for(;;) {
+        while(rec_offset + 51 <= kMFSBlockSize && rec_count < mdb->drNmFls) {
             rec = (MFSDirectoryRecord*)&dir_blk[block][rec_offset];
             rec_size = 51 + rec->flNam[0];
-            if (rec->flFlags) {
+            if (rec->flFlags && rec_offset + rec_size <= kMFSBlockSize) {
                 // record is used, copy it
-                dir[rec_count++] = mfs_directory_record(rec, rec_size);
+                dir[rec_count++] = mfs_directory_record((MFSDirectoryRecord*)arena_pos, rec, rec_size);
+                arena_pos += rec_size + 1;
+                arena_pos += mfs_utf8_from_macroman((char*)arena_pos, 3*rec->flNam[0] + 1, (char*)arena_pos - rec->flNam[0] - 1) + 1;
                 rec_offset += rec_size;
                 if (rec_offset%2) rec_offset++;
             } else break;
@@ -272,17 +521,25 @@ MFSDirectoryRecord ** mfs_directory (MFSVolume *vol) {
         if (rec_count == mdb->drNmFls) break;
     }
     
-    free(dir_blk);
+    mfs_free(vol, dir_blk);
     return dir;
+error:
+    mfs_free(vol, dir_blk);
+    if (dir && !arena) mfs_directory_free(dir);
+    return NULL;
+}
+
+MFSDirectoryRecord ** mfs_directory (MFSVolume *vol) {
+    return mfs_directory_read(vol, 0);
 }
 
 void mfs_directory_free (MFSDirectoryRecord ** dir) {
-    for(int i=0; dir[i]; i++) free(dir[i]);
-    free(dir);
+    if (dir == NULL) return;
+    void *p = (void*)dir - sizeof(MFSVolume*);
+    mfs_free(*(MFSVolume**)p, p);
 }
 
-MFSDirectoryRecord* mfs_directory_record (MFSDirectoryRecord *src, size_t size) {
-    MFSDirectoryRecord *rec = malloc(size+1);
+MFSDirectoryRecord* mfs_directory_record (MFSDirectoryRecord *rec, MFSDirectoryRecord *src, size_t size) {
     memcpy(rec, src, size);
     // null-terminate name
     ((uint8_t*)rec)[size] = '\0';
@@ -317,6 +574,46 @@ MFSDirectoryRecord* mfs_directory_find_name (MFSDirectoryRecord **dir, const cha
     return NULL;
 }
 
+// case-insensitive FNV-1a hash of a MacRoman C string
+uint32_t mfs_name_hash (const uint8_t *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= mfs_chars_toupper[*name++];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// open addressing table of directory indexes + 1, 0 is an empty slot
+int mfs_name_hash_build (MFSVolume *vol) {
+    size_t size = 8;
+    while (size < 2*vol->mdb.drNmFls) size *= 2;
+    vol->nameHash = mfs_arena_alloc(vol, size*sizeof(uint32_t));
+    if (vol->nameHash == NULL) return -1;
+    vol->nameHashSize = size;
+    
+    for(uint32_t i=0; vol->directory[i]; i++) {
+        size_t slot = mfs_name_hash((const uint8_t*)vol->directory[i]->flCName) & (size-1);
+        while (vol->nameHash[slot]) slot = (slot+1) & (size-1);
+        vol->nameHash[slot] = i+1;
+    }
+    return 0;
+}
+
+MFSDirectoryRecord* mfs_directory_lookup (MFSVolume *vol, const char *name) {
+    if (vol->nameHash == NULL) return mfs_directory_find_name(vol->directory, name);
+    size_t mask = vol->nameHashSize-1;
+    size_t namelen = strlen(name);
+    MFSDirectoryRecord *rec;
+    
+    for(size_t slot = mfs_name_hash((const uint8_t*)name) & mask; vol->nameHash[slot]; slot = (slot+1) & mask) {
+        rec = vol->directory[vol->nameHash[slot]-1];
+        if (rec->flNam[0] != namelen) continue;
+        if (mfs_fneq((const uint8_t*)rec->flCName, (const uint8_t*)name)) return rec;
+    }
+    return NULL;
+}
+
 // http://developer.apple.com/technotes/tb/tb_06.html
 // Comments are in Desktop's FCMT resources, as a Str255
 int16_t mfs_comment_id (const char *flCName) {
@@ -336,19 +633,37 @@ int16_t mfs_comment_id (const char *flCName) {
 // pass rec as NULL for the disk's comment
 char * mfs_comment (MFSVolume *vol, MFSDirectoryRecord *rec) {
     if (vol == NULL) return NULL;
-#if defined(USE_LIBRES)
-    int16_t cmtID = mfs_comment_id(rec? rec->flCName : vol->name);
+    return mfs_comment_read(vol, mfs_comment_id(rec? rec->flCName : vol->name));
+}
+
+char * mfs_comment_read (MFSVolume *vol, int16_t cmtID) {
+    // the index knows where comments are, so the resource map isn't needed
+    if (vol->index) return mfs_index_comment(vol, cmtID);
+    MFSResourceFile *desktop = mfs_desktop(vol);
+    MFSResource *res = mfs_res_find(desktop, 'FCMT', cmtID);
+    if (res == NULL) return NULL;
+    // Str255
     unsigned char cmtLen;
-    size_t readBytes;
-    res_read(mfs_desktop(vol), 'FCMT', cmtID, &cmtLen, 0, 1, &readBytes, NULL);
-    if (readBytes == 0) return NULL;
+    if (mfs_res_read(desktop, res, 1, 0, &cmtLen) != 1) return NULL;
     char * comment = malloc((int)cmtLen+1);
-    res_read(mfs_desktop(vol), 'FCMT', cmtID, comment, 1, cmtLen, &readBytes, NULL);
-    comment[cmtLen] = '\0';
+    if (comment == NULL) return NULL;
+    int readBytes = mfs_res_read(desktop, res, cmtLen, 1, comment);
+    comment[(readBytes > 0)? readBytes : 0] = '\0';
     return comment;
-#else
-    return NULL;
-#endif
+}
+
+// adds a Finder comment entry to an AppleDouble header if there's a comment,
+// returns the number of entries
+int mfs_appledouble_comment (MFSVolume *vol, AppleDouble *as, int e, const char *name) {
+    char *comment = mfs_comment_read(vol, mfs_comment_id(name));
+    if (comment == NULL) return e;
+    size_t commentLength = strlen(comment);
+    memcpy((void*)as+kAppleDoubleCommentOffset, comment, commentLength);
+    free(comment);
+    as->entry[e].type = htonl(kAppleDoubleCommentEntry);
+    as->entry[e].offset = htonl(kAppleDoubleCommentOffset);
+    as->entry[e].length = htonl(commentLength);
+    return e + 1;
 }
 
 MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int write) {
@@ -357,9 +672,12 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
     // cannot open non-existant resource forks
     // non-existant data forks behave like empty files
     if ((mode == kMFSForkRsrc) && (rec->flRStBlk == 0)) {errno = ENOENT; return NULL;}
+    // both forks in one stream
+    if ((mode == kMFSForkAppleSingle) || (mode == kMFSForkMacBinary)) return mfs_fkopen_encoded(vol, rec, mode);
     
     uint16_t fkNmBks = (isResourceFork?rec->flRPyLen:rec->flPyLen)/vol->mdb.drAlBlkSiz;
-    MFSFork* fk = malloc(sizeof(MFSFork) + (sizeof(uint16_t)*(fkNmBks+1)));
+    MFSFork* fk = mfs_malloc(vol, sizeof(MFSFork) + (sizeof(uint16_t)*(fkNmBks+1)));
+    if (fk == NULL) return NULL;
     fk->_fkSgn  = 0;
     fk->fkVol   = vol;
     fk->fkDrRec = rec;
@@ -367,6 +685,11 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
     fk->fkLgLen = (isResourceFork?rec->flRLgLen:rec->flLgLen);
     fk->fkNmBks = fkNmBks;
     fk->fkAppleDouble = NULL;
+    fk->fkHeader = NULL;
+    fk->fkHdLen = 0;
+    fk->fkPart[0] = fk->fkPart[1] = NULL;
+    fk->fkAdvice = vol->advice;
+    fk->fkRaOff = fk->fkDropOff = 0;
     fk->fkOffset = 0;
     
     // read allocation map
@@ -381,14 +704,18 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
         if (vol->vabm[lastAlBk] != kMFSAlBkLast) {
             fprintf(stderr, "Invalid allocation block map for %s\n", rec->flCName);
             errno = EFBIG;
-            free(fk);
+            mfs_free(vol, fk);
             return NULL;
         };
     }
     
     // construct AppleDouble header
     if (mode == kMFSForkAppleDouble) {
-        AppleDouble *as = malloc(kAppleDoubleHeaderLength);
+        AppleDouble *as = mfs_malloc(vol, kAppleDoubleHeaderLength);
+        if (as == NULL) {
+            mfs_free(vol, fk);
+            return NULL;
+        }
         fk->fkAppleDouble = as;
         bzero(as, kAppleDoubleHeaderLength);
         
@@ -404,18 +731,9 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
         as->entry[e].length = htonl(kAppleDoubleFinderInfoLength);
         memcpy((void*)as+kAppleDoubleFinderInfoOffset, &rec->flUsrWds, 16);
         e++;
-        /*
+        
         // finder comment
-#ifdef USE_LIBRES
-        size_t commentLength;
-        if (mfs_desktop(vol) && res_read(vol->desktop, 'FCMT', mfs_comment_id(rec->flCName), (void*)as+kAppleDoubleCommentOffset, 0, 256, &commentLength, NULL)) {
-            as->entry[e].type = htonl(kAppleDoubleCommentEntry);
-            as->entry[e].offset = htonl(kAppleDoubleCommentOffset);
-            as->entry[e].length = htonl(commentLength);
-            e++;
-        }
-#endif
-        */
+        e = mfs_appledouble_comment(vol, as, e, rec->flCName);
 		
 		// resource fork
 		// kernel complains if it's not the last entry
@@ -431,7 +749,7 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
     }
     
     // set signature and open forks
-    vol->openForks++;
+    __sync_fetch_and_add(&vol->openForks, 1);
     fk->_fkSgn = kMFSForkSignature;
     return fk;
 }
@@ -439,7 +757,13 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int writ
 MFSFork* mfs_dhopen (MFSVolume *vol, MFSFolder *folder) {
     // open AppleDouble header for folder
     if (folder == NULL) return NULL;
-    MFSFork* fk = malloc(sizeof(MFSFork));
+    MFSFork* fk = mfs_malloc(vol, sizeof(MFSFork));
+    AppleDouble *as = mfs_malloc(vol, kAppleDoubleHeaderLength);
+    if (fk == NULL || as == NULL) {
+        mfs_free(vol, fk);
+        mfs_free(vol, as);
+        return NULL;
+    }
     fk->_fkSgn  = 0;
     fk->fkVol   = vol;
     fk->fkDrRec = NULL;
@@ -447,10 +771,14 @@ MFSFork* mfs_dhopen (MFSVolume *vol, MFSFolder *folder) {
     fk->fkLgLen = 0;
     fk->fkNmBks = 0;
     fk->fkAppleDouble = NULL;
+    fk->fkHeader = NULL;
+    fk->fkHdLen = 0;
+    fk->fkPart[0] = fk->fkPart[1] = NULL;
+    fk->fkAdvice = vol->advice;
+    fk->fkRaOff = fk->fkDropOff = 0;
     fk->fkOffset = 0;
     
     // construct AppleDouble header
-    AppleDouble *as = malloc(kAppleDoubleHeaderLength);
     fk->fkAppleDouble = as;
     bzero(as, kAppleDoubleHeaderLength);
     
@@ -471,37 +799,177 @@ MFSFork* mfs_dhopen (MFSVolume *vol, MFSFolder *folder) {
     memcpy((void*)as+kAppleDoubleFinderInfoOffset, &finfo, 16);
     e++;
     
-    // TODO: finder comment as xattr
-    /*
     // finder comment
-#ifdef USE_LIBRES
-    size_t commentLength;
-    if (mfs_desktop(vol) && res_read(vol->desktop, 'FCMT', mfs_comment_id(folder->fdCNam), (void*)as+kAppleDoubleCommentOffset, 0, 256, &commentLength, NULL)) {
-        as->entry[e].type = htonl(kAppleDoubleCommentEntry);
-        as->entry[e].offset = htonl(kAppleDoubleCommentOffset);
-        as->entry[e].length = htonl(commentLength);
-        e++;
-    }
-#endif
-    */
+    e = mfs_appledouble_comment(vol, as, e, folder->fdCNam);
+    
     // number of entries written
     as->numEntries = htons(e);
     
     // set signature and open forks
-    vol->openForks++;
+    __sync_fetch_and_add(&vol->openForks, 1);
     fk->_fkSgn = kMFSForkSignature;
     return fk;
 }
 
+// AppleSingle or MacBinary stream: header, data fork and resource fork
+MFSFork* mfs_fkopen_encoded (MFSVolume *vol, MFSDirectoryRecord *rec, int mode) {
+    MFSFork* fk = mfs_calloc(vol, 1, sizeof(MFSFork));
+    if (fk == NULL) return NULL;
+    fk->fkVol   = vol;
+    fk->fkDrRec = rec;
+    fk->fkMode  = mode;
+    fk->fkAdvice = vol->advice;
+    
+    // open forks
+    fk->fkPart[0] = mfs_fkopen(vol, rec, kMFSForkData, 0);
+    if (fk->fkPart[0] == NULL) goto error;
+    if (rec->flRStBlk) {
+        fk->fkPart[1] = mfs_fkopen(vol, rec, kMFSForkRsrc, 0);
+        if (fk->fkPart[1] == NULL) goto error;
+    }
+    
+    // construct header
+    if (mode == kMFSForkAppleSingle) fk->fkHeader = mfs_applesingle_header(fk);
+    else fk->fkHeader = mfs_macbinary_header(fk);
+    if (fk->fkHeader == NULL) goto error;
+    
+    // set signature and open forks
+    __sync_fetch_and_add(&vol->openForks, 1);
+    fk->_fkSgn = kMFSForkSignature;
+    return fk;
+error:
+    if (fk->fkPart[0]) mfs_fkclose(fk->fkPart[0]);
+    if (fk->fkPart[1]) mfs_fkclose(fk->fkPart[1]);
+    mfs_free(vol, fk);
+    return NULL;
+}
+
+// sets header length, part offsets and total length of an AppleSingle fork
+AppleDouble * mfs_applesingle_header (MFSFork *fk) {
+    MFSDirectoryRecord *rec = fk->fkDrRec;
+    uint32_t dataLen = fk->fkPart[0]->fkLgLen;
+    uint32_t rsrcLen = fk->fkPart[1]? fk->fkPart[1]->fkLgLen : 0;
+    int numEntries = fk->fkPart[1]? 5 : 4;
+    uint32_t nameOff = sizeof(AppleDouble) + numEntries*sizeof(AppleDoubleEntry);
+    uint32_t datesOff = nameOff + rec->flNam[0];
+    uint32_t finfoOff = datesOff + sizeof(AppleDoubleFileDates);
+    uint32_t hdLen = finfoOff + kAppleDoubleFinderInfoLength;
+    AppleDouble *as = mfs_calloc(fk->fkVol, 1, hdLen);
+    if (as == NULL) return NULL;
+    
+    // header, filler is zeroes
+    as->magic = htonl(kAppleSingleMagic);
+    as->version = htonl(kAppleDoubleVersion);
+    as->numEntries = htons(numEntries);
+    int e = 0;
+    
+    // real name
+    as->entry[e].type = htonl(kAppleDoubleRealNameEntry);
+    as->entry[e].offset = htonl(nameOff);
+    as->entry[e].length = htonl(rec->flNam[0]);
+    memcpy((void*)as+nameOff, rec->flCName, rec->flNam[0]);
+    e++;
+    
+    // dates
+    AppleDoubleFileDates *dates = (void*)as+datesOff;
+    dates->creationDate = htonl((int32_t)(mfs_time(rec->flCrDat) - kAppleDoubleDateDelta));
+    dates->modificationDate = htonl((int32_t)(mfs_time(rec->flMdDat) - kAppleDoubleDateDelta));
+    dates->backupDate = htonl(0x80000000); // unknown
+    dates->accessDate = htonl(0x80000000);
+    as->entry[e].type = htonl(kAppleDoubleFileDatesEntry);
+    as->entry[e].offset = htonl(datesOff);
+    as->entry[e].length = htonl(sizeof(AppleDoubleFileDates));
+    e++;
+    
+    // finder info
+    as->entry[e].type = htonl(kAppleDoubleFinderInfoEntry);
+    as->entry[e].offset = htonl(finfoOff);
+    as->entry[e].length = htonl(kAppleDoubleFinderInfoLength);
+    memcpy((void*)as+finfoOff, &rec->flUsrWds, 16);
+    e++;
+    
+    // forks
+    as->entry[e].type = htonl(kAppleDoubleDataForkEntry);
+    as->entry[e].offset = htonl(hdLen);
+    as->entry[e].length = htonl(dataLen);
+    e++;
+    if (fk->fkPart[1]) {
+        as->entry[e].type = htonl(kAppleDoubleResourceForkEntry);
+        as->entry[e].offset = htonl(hdLen + dataLen);
+        as->entry[e].length = htonl(rsrcLen);
+        e++;
+    }
+    
+    fk->fkHdLen = hdLen;
+    fk->fkPartOff[0] = hdLen;
+    fk->fkPartOff[1] = hdLen + dataLen;
+    fk->fkLgLen = hdLen + dataLen + rsrcLen;
+    return as;
+}
+
+// sets header length, part offsets and total length of a MacBinary III fork
+MacBinaryHeader * mfs_macbinary_header (MFSFork *fk) {
+    MFSDirectoryRecord *rec = fk->fkDrRec;
+    uint32_t dataLen = fk->fkPart[0]->fkLgLen;
+    uint32_t rsrcLen = fk->fkPart[1]? fk->fkPart[1]->fkLgLen : 0;
+    uint16_t flags = ntohs(rec->flUsrWds.flags);
+    MacBinaryHeader *mb = mfs_calloc(fk->fkVol, 1, kMacBinaryHeaderLength);
+    if (mb == NULL) return NULL;
+    
+    // MFS allows longer names than MacBinary
+    mb->nameLength = (rec->flNam[0] > sizeof mb->name)? sizeof mb->name : rec->flNam[0];
+    memcpy(mb->name, rec->flCName, mb->nameLength);
+    // finder info, already big endian
+    mb->type = rec->flUsrWds.type;
+    mb->creator = rec->flUsrWds.creator;
+    mb->flagsHigh = flags >> 8;
+    mb->flagsLow = flags & 0xFF;
+    mb->locV = rec->flUsrWds.loc.v;
+    mb->locH = rec->flUsrWds.loc.h;
+    mb->folder = rec->flUsrWds.folder;
+    mb->locked = rec->flFlags & 1;
+    // forks and dates
+    mb->dataLength = htonl(dataLen);
+    mb->rsrcLength = htonl(rsrcLen);
+    mb->creationDate = htonl(rec->flCrDat);
+    mb->modificationDate = htonl(rec->flMdDat);
+    // version and checksum
+    mb->signature = htonl(kMacBinarySignature);
+    mb->version = kMacBinaryVersion;
+    mb->minVersion = kMacBinaryMinVersion;
+    mb->crc = htons(mfs_crc16(0, mb, offsetof(MacBinaryHeader, crc)));
+    
+    // forks are padded
+    fk->fkHdLen = kMacBinaryHeaderLength;
+    fk->fkPartOff[0] = kMacBinaryHeaderLength;
+    fk->fkPartOff[1] = fk->fkPartOff[0] + mfs_round(dataLen, kMacBinaryPadding);
+    fk->fkLgLen = fk->fkPartOff[1] + mfs_round(rsrcLen, kMacBinaryPadding);
+    return mb;
+}
+
+// CRC-16/XMODEM, pass the previous result to continue a checksum
+uint16_t mfs_crc16 (uint16_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len--) {
+        crc ^= *p++ << 8;
+        for(int i=0; i < 8; i++) crc = (crc & 0x8000)? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
 int mfs_fkclose (MFSFork *fk) {
     if (fk->_fkSgn != kMFSForkSignature) {
         errno = EBADF;
         return -1;
     }
     fk->_fkSgn = 0;
-    if (fk->fkAppleDouble) free(fk->fkAppleDouble);
-    fk->fkVol->openForks--;
-    free(fk);
+    MFSVolume *vol = fk->fkVol;
+    mfs_free(vol, fk->fkAppleDouble);
+    mfs_free(vol, fk->fkHeader);
+    if (fk->fkPart[0]) mfs_fkclose(fk->fkPart[0]);
+    if (fk->fkPart[1]) mfs_fkclose(fk->fkPart[1]);
+    __sync_fetch_and_sub(&vol->openForks, 1);
+    mfs_free(vol, fk);
     return 0;
 }
 
@@ -512,7 +980,18 @@ int mfs_fkread_at (MFSFork *fk, size_t size, size_t offset, void *buf) {
             return mfs_fkread_at_real(fk, size, offset, buf);
         case kMFSForkAppleDouble:
             return mfs_fkread_at_appledouble(fk, size, offset, buf);
+        case kMFSForkAppleSingle:
+        case kMFSForkMacBinary:
+            return mfs_fkread_at_encoded(fk, size, offset, buf);
     }
+    errno = EINVAL;
+    return -1;
+}
+
+// length of the fork as read by mfs_fkread_at
+size_t mfs_fksize (MFSFork *fk) {
+    if (fk->fkMode == kMFSForkAppleDouble) return kAppleDoubleHeaderLength + fk->fkLgLen;
+    return fk->fkLgLen;
 }
 
 unsigned long mfs_fkread (void *fk, void *buf, unsigned long length) {
@@ -521,7 +1000,7 @@ unsigned long mfs_fkread (void *fk, void *buf, unsigned long length) {
 
 unsigned long mfs_fkseek (void *fk, long offset, int whence) {
     // set offset
-    uint32_t fkLen = ((MFSFork*)fk)->fkLgLen + ((((MFSFork*)fk)->fkMode == kMFSForkAppleDouble)? kAppleDoubleHeaderLength : 0);
+    uint32_t fkLen = mfs_fksize((MFSFork*)fk);
     
     switch(whence) {
         case SEEK_SET:
@@ -555,96 +1034,328 @@ int mfs_fkread_at_appledouble (MFSFork *fk, size_t size, size_t offset, void *bu
     size_t btr = size;
     size_t hdBtr = kAppleDoubleHeaderLength - offset;
     if (hdBtr > size) hdBtr = size;
-    memcpy(buf, fk->fkAppleDouble, hdBtr);
+    memcpy(buf, (void*)fk->fkAppleDouble + offset, hdBtr);
     btr -= hdBtr;
     buf += hdBtr;
     
     // read from fork
-    if (btr) return hdBtr + mfs_fkread_at_real(fk, btr, 0, buf);
+    if (btr) {
+        int rb = mfs_fkread_at_real(fk, btr, 0, buf);
+        return (rb == -1)? -1 : (int)hdBtr + rb;
+    }
     return size;
 }
 
+// describe size bytes of a fork from offset as segments in memory (the AppleDouble
+// header) or in the image, without reading them. returns the number of segments
+// filled in, up to maxSegs, or -1 on error. segments cover less than size bytes if
+// maxSegs is reached, the caller can continue from where they end.
+ssize_t mfs_fksegments (MFSFork *fk, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs) {
+    if (fk->_fkSgn != kMFSForkSignature) {errno = EBADF; return -1;}
+    if (fk->fkHeader) return mfs_fksegments_encoded(fk, size, offset, seg, maxSegs);
+    MFSVolume *vol = fk->fkVol;
+    size_t hdLen = (fk->fkMode == kMFSForkAppleDouble)? kAppleDoubleHeaderLength : 0;
+    size_t nseg = 0;
+    if (offset >= hdLen + fk->fkLgLen) return 0;
+    if (offset + size > hdLen + fk->fkLgLen) size = hdLen + fk->fkLgLen - offset;
+    
+    // AppleDouble header
+    if (offset < hdLen && nseg < maxSegs) {
+        seg[nseg].data = (void*)fk->fkAppleDouble + offset;
+        seg[nseg].offset = 0;
+        seg[nseg].length = (hdLen - offset < size)? hdLen - offset : size;
+        size -= seg[nseg].length;
+        offset = hdLen;
+        nseg++;
+    }
+    
+    // runs of contiguous blocks in the image
+    offset -= hdLen;
+    size_t alBkSiz = vol->mdb.drAlBlkSiz;
+    size_t bkn = offset / alBkSiz;
+    size_t bkOff = offset % alBkSiz;
+    size_t runBks, runLen;
+    off_t runOff;
+    for(; size && nseg < maxSegs; size -= runLen, bkOff = 0) {
+        if ((runBks = mfs_fkrun(fk, bkn, bkOff, size, &runOff, &runLen)) == 0) {errno = EIO; return -1;}
+        seg[nseg].data = vol->src.base? vol->src.base + vol->offset + runOff : NULL;
+        seg[nseg].offset = vol->offset + runOff;
+        seg[nseg].length = runLen;
+        nseg++;
+        bkn += runBks;
+    }
+    
+    return nseg;
+}
+
+ssize_t mfs_fksegments_encoded (MFSFork *fk, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs) {
+    static const uint8_t zeroes[kMacBinaryPadding];
+    if (offset >= fk->fkLgLen) return 0;
+    if (offset + size > fk->fkLgLen) size = fk->fkLgLen - offset;
+    
+    size_t nseg = 0, len;
+    ssize_t pseg;
+    for(; size && nseg < maxSegs; size -= len, offset += len) {
+        if (offset < fk->fkHdLen) {
+            // header
+            len = fk->fkHdLen - offset;
+            if (len > size) len = size;
+            seg[nseg].data = fk->fkHeader + offset;
+            seg[nseg].offset = 0;
+            seg[nseg++].length = len;
+            continue;
+        }
+        int p = (offset >= fk->fkPartOff[1]);
+        size_t partOff = offset - fk->fkPartOff[p];
+        size_t partLen = fk->fkPart[p]? fk->fkPart[p]->fkLgLen : 0;
+        size_t partEnd = p? fk->fkLgLen : fk->fkPartOff[1];
+        if (partOff < partLen) {
+            // fork, may not fit in the segments left
+            len = partLen - partOff;
+            if (len > size) len = size;
+            pseg = mfs_fksegments(fk->fkPart[p], len, partOff, seg+nseg, maxSegs-nseg);
+            if (pseg == -1) return -1;
+            for(len = 0; pseg; pseg--) len += seg[nseg++].length;
+        } else {
+            // padding, less than kMacBinaryPadding
+            len = partEnd - offset;
+            if (len > size) len = size;
+            seg[nseg].data = zeroes;
+            seg[nseg].offset = 0;
+            seg[nseg++].length = len;
+        }
+    }
+    
+    return nseg;
+}
+
+int mfs_vfileno (MFSVolume *vol) {
+    if (vol->src.fileno == NULL) {errno = ENOTSUP; return -1;}
+    return vol->src.fileno(vol->src.ctx);
+}
+
+int mfs_fkread_at_encoded (MFSFork *fk, size_t size, size_t offset, void *buf) {
+    if (size == 0) return 0;
+    if (offset >= fk->fkLgLen) return 0;
+    if (offset + size > fk->fkLgLen) size = fk->fkLgLen - offset;
+    
+    size_t btr, len;
+    for(btr = size; btr; btr -= len, offset += len, buf += len) {
+        if (offset < fk->fkHdLen) {
+            // header
+            len = fk->fkHdLen - offset;
+            if (len > btr) len = btr;
+            memcpy(buf, fk->fkHeader + offset, len);
+            continue;
+        }
+        int p = (offset >= fk->fkPartOff[1]);
+        size_t partOff = offset - fk->fkPartOff[p];
+        size_t partLen = fk->fkPart[p]? fk->fkPart[p]->fkLgLen : 0;
+        size_t partEnd = p? fk->fkLgLen : fk->fkPartOff[1];
+        if (partOff < partLen) {
+            // fork
+            len = partLen - partOff;
+            if (len > btr) len = btr;
+            if (mfs_fkread_at_real(fk->fkPart[p], len, partOff, buf) != (int)len) return -1;
+        } else {
+            // padding
+            len = partEnd - offset;
+            if (len > btr) len = btr;
+            memset(buf, 0, len);
+        }
+    }
+    
+    return (int)size;
+}
+
+// find the run of contiguous allocation blocks at block index bkn of a fork, starting
+// bkOff bytes into the block and at most size bytes long. returns the number of blocks
+// in the run (0 if bkn is past the end), and sets its offset and length in the volume
+size_t mfs_fkrun (MFSFork *fk, size_t bkn, size_t bkOff, size_t size, off_t *runOff, size_t *runLen) {
+    size_t alBkSiz = fk->fkVol->mdb.drAlBlkSiz;
+    if (bkn >= fk->fkNmBks) return 0;
+    size_t runBks = 1;
+    size_t runBtr = alBkSiz - bkOff;
+    while (runBtr < size && bkn+runBks < fk->fkNmBks && fk->fkAlMap[bkn+runBks] == fk->fkAlMap[bkn+runBks-1]+1) {
+        runBtr += alBkSiz;
+        runBks++;
+    }
+    if (runBtr > size) runBtr = size;
+    *runOff = (off_t)fk->fkVol->alBkOff + (off_t)alBkSiz*fk->fkAlMap[bkn] + bkOff;
+    *runLen = runBtr;
+    return runBks;
+}
+
 int mfs_fkread_at_real (MFSFork *fk, size_t size, size_t offset, void *buf) {
     if (size == 0) return 0;
     if (offset >= fk->fkLgLen) return 0;
     if (offset + size > fk->fkLgLen) size = fk->fkLgLen - offset;
     
-    // read blocks and copy data
-    size_t btr = size;  // total bytes to read
-    size_t bkBtr;       // bytes to read from block
-    uint16_t bkn = offset / (fk->fkVol->mdb.drAlBlkSiz); // block index
-    size_t bk1Off = offset % (fk->fkVol->mdb.drAlBlkSiz); // offset in first block
-    void *bk = malloc(fk->fkVol->mdb.drAlBlkSiz);
-    
-    // read first block
-    mfs_albkread(fk->fkVol, 1, fk->fkAlMap[bkn], bk);
-    bkBtr = (fk->fkVol->mdb.drAlBlkSiz - bk1Off); // maximum bytes readable from first block
-    if (bkBtr > btr) bkBtr = btr;
-    memcpy(buf, bk+bk1Off, bkBtr);
-    btr -= bkBtr;
-    buf += bkBtr;
-    bkn++;
-    
-    // read other blocks
-    while(btr) {
-        // read block
-        mfs_albkread(fk->fkVol, 1, fk->fkAlMap[bkn], bk);
-        // bytes to read
-        if (btr >= fk->fkVol->mdb.drAlBlkSiz) bkBtr = fk->fkVol->mdb.drAlBlkSiz;
-        else bkBtr = btr;
-        // copy
-        memcpy(buf, bk, bkBtr);
-        // advance
-        btr -= bkBtr;
-        buf += bkBtr;
-        bkn++;
-    }
-    
-    free(bk);
+    MFSVolume *vol = fk->fkVol;
+    size_t alBkSiz = vol->mdb.drAlBlkSiz;
+    size_t btr;                     // bytes to read
+    size_t bkn;                     // block index
+    size_t bkOff;                   // offset in block
+    size_t runBks, runLen;
+    off_t runOff;
+    
+    // if the read is fragmented, let the source fetch all runs at once
+    bkn = offset / alBkSiz;
+    bkOff = offset % alBkSiz;
+    if (vol->src.prefetch && mfs_fkrun(fk, bkn, bkOff, size, &runOff, &runLen) && runLen < size) {
+        for(btr = size; btr; btr -= runLen, bkOff = 0) {
+            if ((runBks = mfs_fkrun(fk, bkn, bkOff, btr, &runOff, &runLen)) == 0) break;
+            mfs_prefetch(vol, runLen, runOff);
+            bkn += runBks;
+        }
+        bkn = offset / alBkSiz;
+        bkOff = offset % alBkSiz;
+    }
+    
+    // read runs of contiguous blocks straight into buf
+    for(btr = size; btr; btr -= runLen, bkOff = 0) {
+        if ((runBks = mfs_fkrun(fk, bkn, bkOff, btr, &runOff, &runLen)) == 0) {errno = EIO; return -1;}
+        if (-1 == mfs_read_at(vol, buf, runLen, runOff)) return -1;
+        buf += runLen;
+        bkn += runBks;
+    }
+    
+    // sequential reads keep a window read ahead, and drop what's behind them from the cache
+    // so they don't push out what other readers of the volume are using
+    if (fk->fkAdvice == kMFSAdviseSequential) {
+        size_t end = offset + size;
+        if (end + kMFSReadAhead/2 > fk->fkRaOff && end < fk->fkLgLen) {
+            size_t raOff = (fk->fkRaOff > end)? fk->fkRaOff : end;
+            fk->fkRaOff = end + kMFSReadAhead;
+            mfs_fkadvise_real(fk, fk->fkRaOff - raOff, raOff, kMFSAdviseWillNeed);
+        }
+        if (offset >= fk->fkDropOff + kMFSReadAhead) {
+            mfs_fkadvise_real(fk, offset - fk->fkDropOff, fk->fkDropOff, kMFSAdviseDontNeed);
+            fk->fkDropOff = offset;
+        }
+    }
+    
     return (int)size;
 }
 
-#ifdef USE_LIBRES
-RFILE * mfs_desktop (MFSVolume *vol) {
+// pass advice on to the source for each run of the fork in a range
+int mfs_fkadvise_real (MFSFork *fk, size_t size, size_t offset, int advice) {
+    MFSVolume *vol = fk->fkVol;
+    size_t alBkSiz = vol->mdb.drAlBlkSiz;
+    size_t btr, runBks, runLen;
+    off_t runOff;
+    if (offset >= fk->fkLgLen) return 0;
+    if (size == 0 || offset + size > fk->fkLgLen) size = fk->fkLgLen - offset;
+    
+    size_t bkn = offset / alBkSiz;
+    size_t bkOff = offset % alBkSiz;
+    for(btr = size; btr; btr -= runLen, bkOff = 0) {
+        if ((runBks = mfs_fkrun(fk, bkn, bkOff, btr, &runOff, &runLen)) == 0) {errno = EIO; return -1;}
+        mfs_advise(vol, runLen, runOff, advice);
+        bkn += runBks;
+    }
+    return 0;
+}
+
+// hint how a range of a fork will be read, size 0 is to the end of the fork
+// sequential and random stay in effect for later reads
+int mfs_fkadvise (MFSFork *fk, size_t size, size_t offset, int advice) {
+    if (fk->_fkSgn != kMFSForkSignature) {errno = EBADF; return -1;}
+    if (advice < kMFSAdviseNormal || advice > kMFSAdviseDontNeed) {errno = EINVAL; return -1;}
+    
+    // AppleSingle and MacBinary pass it on to both forks
+    if (fk->fkHeader) {
+        if (advice <= kMFSAdviseRandom) fk->fkAdvice = advice;
+        for(int i=0; i < 2; i++)
+            if (fk->fkPart[i] && -1 == mfs_fkadvise(fk->fkPart[i], 0, 0, advice)) return -1;
+        return 0;
+    }
+    
+    // offsets in the resource fork, for AppleDouble
+    if (fk->fkMode == kMFSForkAppleDouble) {
+        size_t end = offset + size;
+        if (size && end <= kAppleDoubleResourceForkOffset) return 0;
+        offset = (offset > kAppleDoubleResourceForkOffset)? offset - kAppleDoubleResourceForkOffset : 0;
+        if (size) size = end - kAppleDoubleResourceForkOffset - offset;
+    }
+    if (advice <= kMFSAdviseRandom) {
+        fk->fkAdvice = advice;
+        fk->fkRaOff = fk->fkDropOff = offset;
+    }
+    return mfs_fkadvise_real(fk, size, offset, advice);
+}
+
+// hint how the whole volume will be read, sequential and random also apply to forks opened after this
+int mfs_vadvise (MFSVolume *vol, int advice) {
+    if (advice < kMFSAdviseNormal || advice > kMFSAdviseDontNeed) {errno = EINVAL; return -1;}
+    if (advice <= kMFSAdviseRandom) vol->advice = advice;
+    uint64_t size = vol->src.size? vol->src.size(vol->src.ctx) : 0;
+    if (size > vol->offset) mfs_advise(vol, size - vol->offset, 0, advice);
+    return 0;
+}
+
+MFSResourceFile * mfs_desktop (MFSVolume *vol) {
+    // initialized once, by whichever thread gets here first
+    pthread_mutex_lock(&vol->lock);
     if (vol->desktop == NULL) {
-        MFSDirectoryRecord *dr = mfs_directory_find_name(vol->directory, "Desktop");
-        MFSFork *df = mfs_fkopen(vol, dr, kMFSForkRsrc, 0);
-        void* desktopData = malloc(df->fkLgLen);
-        mfs_fkread_at(df, df->fkLgLen, 0, desktopData);
-        vol->desktop = res_open_mem(desktopData, df->fkLgLen, 0);
-        mfs_fkclose(df);
+        MFSDirectoryRecord *dr = mfs_directory_lookup(vol, "Desktop");
+        MFSFork *fk = (dr && dr->flRStBlk)? mfs_fkopen(vol, dr, kMFSForkRsrc, 0) : NULL;
+        // shared by every thread like mfs_desktop_fork, so no read-ahead state
+        if (fk) fk->fkAdvice = kMFSAdviseNormal;
+        vol->desktop = mfs_res_open(fk);
+        // the volume can be closed with the Desktop fork open
+        if (vol->desktop) __sync_fetch_and_sub(&vol->openForks, 1);
     }
+    pthread_mutex_unlock(&vol->lock);
     return vol->desktop;
 }
 
+// Desktop resource fork on its own, for resources at known offsets
+MFSFork * mfs_desktop_fork (MFSVolume *vol) {
+    MFSFork *fk = __atomic_load_n(&vol->desktopFork, __ATOMIC_ACQUIRE);
+    if (fk) return fk;
+    pthread_mutex_lock(&vol->lock);
+    if (vol->desktopFork == NULL) {
+        MFSDirectoryRecord *dr = mfs_directory_lookup(vol, "Desktop");
+        if (dr && dr->flRStBlk && (fk = mfs_fkopen(vol, dr, kMFSForkRsrc, 0))) {
+            // shared by every thread, so it can't keep read-ahead state
+            fk->fkAdvice = kMFSAdviseNormal;
+            __sync_fetch_and_sub(&vol->openForks, 1);
+            __atomic_store_n(&vol->desktopFork, fk, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&vol->lock);
+    return vol->desktopFork;
+}
+
 int mfs_load_folders (MFSVolume *vol) {
     size_t  count;
     int     i;
     
-    if (vol->desktop == NULL) vol->desktop = mfs_desktop(vol);
-    if (vol->desktop == NULL) return 0;
-    ResAttr * fobj = res_list(vol->desktop, 'FOBJ', NULL, 0, 0, &count, NULL);
+    MFSResourceFile *desktop = mfs_desktop(vol);
+    if (desktop == NULL) return 0;
+    MFSResource * fobj = mfs_res_list(desktop, 'FOBJ', &count);
     if (fobj == NULL) return 0;
-    vol->folders = calloc(count, sizeof(struct MFSFolder));
-    if (vol->folders == NULL) return 0;
-    bzero(vol->folders, sizeof(struct MFSFolder)*count);
+    vol->folders = mfs_arena_alloc(vol, count*sizeof(struct MFSFolder));
+    if (vol->folders == NULL) return -1;
     vol->numFolders = count;
     
     // fill
     for(i=0; i < count; i++) {
-        vol->folders[i].fdID = fobj[i].ID;
-        strncpy(vol->folders[i].fdCNam, fobj[i].name, 65); // stupid linux has no strlcpy
+        vol->folders[i].fdID = fobj[i].id;
+        if (fobj[i].name) strncpy(vol->folders[i].fdCNam, fobj[i].name, 65); // stupid linux has no strlcpy
         vol->folders[i].fdCNam[64] = '\0';
+        mfs_utf8_from_macroman(vol->folders[i].fdUName, sizeof vol->folders[i].fdUName, vol->folders[i].fdCNam);
         
         // FOBJ resource
-        FOBJrsrc * fr = res_read(vol->desktop, 'FOBJ', fobj[i].ID, NULL, 0, sizeof(FOBJrsrc), NULL, NULL);
-        if (fr) {
-            vol->folders[i].fdParent = ntohs(fr->parent);
-            vol->folders[i].fdCrDat = ntohl(fr->fdCrDat);
-            vol->folders[i].fdMdDat = ntohl(fr->fdMdDat);
-            vol->folders[i].fdFlags = ntohl(fr->fdFlags);
-            vol->folders->fdLocV = ntohs(fr->fdIconPos.v);
-            vol->folders->fdLocH = ntohs(fr->fdIconPos.h);
+        FOBJrsrc fr;
+        if (mfs_res_read(desktop, &fobj[i], sizeof(FOBJrsrc), 0, &fr) == sizeof(FOBJrsrc)) {
+            vol->folders[i].fdParent = ntohs(fr.parent);
+            vol->folders[i].fdCrDat = ntohl(fr.fdCrDat);
+            vol->folders[i].fdMdDat = ntohl(fr.fdMdDat);
+            vol->folders[i].fdFlags = ntohs(fr.fdFlags);
+            vol->folders[i].fdLocV = ntohs(fr.fdIconPos.v);
+            vol->folders[i].fdLocH = ntohs(fr.fdIconPos.h);
         }
         
         vol->folders[i].fdSubdirs = 0;
@@ -666,10 +1377,8 @@ int mfs_load_folders (MFSVolume *vol) {
 	fflush(stderr);
     #endif
     
-    free(fobj);
     return count;
 }
-#endif
 
 MFSFolder* mfs_folder_find (MFSVolume *vol, int16_t fdID) {
     if (fdID == -2) return NULL;
@@ -694,7 +1403,7 @@ int mfs_path_info (MFSVolume *vol, const char *path) {
     MFSDirectoryRecord *rec;
     
     // check if last item exists
-    rec = mfs_directory_find_name(vol->directory, last);
+    rec = mfs_directory_lookup(vol, last);
     if (vol->folders == NULL) return rec?kMFSPathFile:kMFSPathError;
     if ((mfs_folder_find_name(vol, last) == NULL) && (rec == NULL))
         return kMFSPathError;
@@ -734,27 +1443,28 @@ fail:
     return kMFSPathError;
 }
 
+// array of MacRoman uppercase equivalents, taken from system 6
+const uint8_t mfs_chars_toupper[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+    0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0xCB, 0x89, 0x80, 0xCC, 0x81, 0x82, 0x83, 0x8F,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x84, 0x97, 0x98, 0x99, 0x85, 0xCD, 0x9C, 0x9D, 0x9E, 0x86,
+    0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
+    0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xAE, 0xAF,
+    0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF,
+    0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
+    0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
+    0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
+};
+
 int mfs_fneq (const uint8_t *s1, const uint8_t *s2) {
     // return 1 if MFS filenames are equal, 0 otherwise
-    static const uint8_t mfs_chars_toupper[256] = {
-        // array of MacRoman uppercase equivalents, taken from system 6
-        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
-        0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
-        0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
-        0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
-        0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
-        0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
-        0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0xCB, 0x89, 0x80, 0xCC, 0x81, 0x82, 0x83, 0x8F,
-        0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x84, 0x97, 0x98, 0x99, 0x85, 0xCD, 0x9C, 0x9D, 0x9E, 0x86,
-        0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
-        0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xAE, 0xAF,
-        0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF,
-        0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
-        0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
-        0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
-    };
     while (mfs_chars_toupper[*s1] == mfs_chars_toupper[*s2++])
         if (*s1++ == 0) return 1;
     return 0;
@@ -22,15 +22,11 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <time.h>
-#ifdef USE_LIBRES
-#include <libres/res.h>
-#define DESKTOP_TYPE RFILE*
-#else
-#define DESKTOP_TYPE void*
-#endif
+#include <pthread.h>
 #include "appledouble.h"
 
 #define kMFSBlockSize       512
@@ -50,7 +46,9 @@ extern const char * libmfs_id;
 enum {
     kMFSForkData,
     kMFSForkRsrc,
-    kMFSForkAppleDouble
+    kMFSForkAppleDouble,
+    kMFSForkAppleSingle,
+    kMFSForkMacBinary
 };
 
 // result from mfs_path_info
@@ -82,9 +80,32 @@ enum {
 
 // flags for mfs_vopen
 enum {
-    MFS_FOLDERS = 1
+    MFS_FOLDERS = 1,
+    MFS_INDEX   = 2     // use (and update) a sidecar index next to the image
+};
+
+// flags for mfs_diff
+enum {
+    MFS_DIFF_CONTENTS = 1   // compare contents of every fork with the same length
+};
+
+// access pattern hints for mfs_fkadvise and mfs_vadvise
+enum {
+    kMFSAdviseNormal,
+    kMFSAdviseSequential,   // read ahead, and drop what's been read from the cache
+    kMFSAdviseRandom,       // don't read ahead
+    kMFSAdviseWillNeed,     // fetch into the cache now
+    kMFSAdviseDontNeed      // drop from the cache now
 };
 
+// flags for mfs_tar
+enum {
+    MFS_TAR_APPLEDOUBLE = 1 // resource forks and Finder info in ._ files instead of pax xattrs
+};
+
+// sidecar index file name is the image path with this appended
+#define kMFSIndexSuffix     ".mfsidx"
+
 struct __attribute__ ((__packed__)) MFSMasterDirectoryBlock {
     uint16_t    drSigWord;      // always 0xD2D7
     uint32_t    drCrDate;       // date and time of initialization
@@ -148,21 +169,78 @@ struct MFSFolder {
     int16_t     fdFlags;        // finder flags
     int16_t     fdLocV, fdLocH; // icon position
     char        fdCNam[65];     // MacRoman C string
+    char        fdUName[193];   // UTF-8 C string, see mfs_utf8_from_macroman
 };
 typedef struct MFSFolder MFSFolder;
 
+struct MFSResourceFile;
+struct MFSDirectoryColumns;
+struct MFSComment;
+struct MFSFork;
+
+// where volume data comes from, see mfs_vopen_source
+struct MFSBlockSource {
+    void        *ctx;
+    // read up to size bytes at offset, return bytes read (0 at end) or -1 and set errno
+    ssize_t     (*read_at)(void *ctx, void *buf, size_t size, uint64_t offset);
+    // total size in bytes
+    uint64_t    (*size)(void *ctx);
+    // optional: a range is about to be read
+    void        (*prefetch)(void *ctx, uint64_t offset, size_t size);
+    // optional: file descriptor to splice/sendfile from, see mfs_vfileno
+    int         (*fileno)(void *ctx);
+    // optional: called when the volume is closed
+    void        (*close)(void *ctx);
+    // optional: the whole source is in memory at this address
+    const void  *base;
+    // optional: how a range will be read (kMFSAdvise*)
+    void        (*advise)(void *ctx, uint64_t offset, size_t size, int advice);
+};
+typedef struct MFSBlockSource MFSBlockSource;
+
+// where a volume's memory comes from, see mfs_vopen_alloc
+// called from any thread using the volume
+struct MFSAllocator {
+    void        *ctx;
+    // size bytes aligned for any type, or NULL and set errno
+    void *      (*alloc)(void *ctx, size_t size);
+    // size is what was passed to alloc
+    void        (*free)(void *ctx, void *ptr, size_t size);
+};
+typedef struct MFSAllocator MFSAllocator;
+
 struct MFSVolume {
-    FILE                    *fp;
+    MFSBlockSource          src;
     size_t                  offset;     // offset to start of volume (for mounting disk images with header)
     size_t                  alBkOff;    // offset to allocation block 0
-    size_t                  openForks;  // number of open forks
+    size_t                  openForks;  // number of open forks, changed atomically
+    int                     flags;      // flags passed to mfs_vopen
+    int                     advice;     // for forks opened from now on, see mfs_vadvise
+    time_t                  mtime;      // modification time of image, 0 if unknown
     MFSMasterDirectoryBlock mdb;
     MFSVABM                 vabm;
     MFSDirectoryRecord      **directory;
     size_t                  numFolders;
     MFSFolder               *folders;
-    DESKTOP_TYPE            desktop;
+    struct MFSResourceFile  *desktop;   // Desktop file resources, see mfs_desktop
     char                    name[28];
+    char                    uname[82];  // UTF-8 volume name
+    uint32_t                *nameHash;  // directory indexes by case-folded name hash
+    size_t                  nameHashSize;
+    void                    *index;     // mapped sidecar index, if any
+    size_t                  indexLen;
+    struct MFSComment       *comments;  // Finder comments from the index, sorted by ID
+    size_t                  numComments;
+    struct MFSFork          *desktopFork; // Desktop resource fork, for comments from the index
+    char                    *foldedNames; // case-folded names separated by NULs, see mfs_search
+    uint32_t                *foldedOff;   // offset of each record's name in foldedNames
+    uint64_t                *allocBits;   // used allocation blocks, see mfs_alloc_report
+    struct MFSDirectoryColumns *columns;  // see mfs_columns
+    MFSAllocator            alloc;
+    void                    *arena;     // chunks of memory kept until the volume is closed
+    void                    *arenaPos, *arenaEnd; // free space in the newest chunk
+    size_t                  memory;     // bytes from alloc, changed atomically, see mfs_vmemory
+    pthread_mutex_t         lock;       // guards lazy initialization
 };
 typedef struct MFSVolume MFSVolume;
 
@@ -171,23 +249,199 @@ struct MFSFork {
     uint32_t            _fkSgn;     // signature
     MFSVolume           *fkVol;     // parent volume
     MFSDirectoryRecord  *fkDrRec;   // directory record
-    uint32_t            fkLgLen;    // fork length (bytes)
+    uint32_t            fkLgLen;    // fork length (bytes), whole stream for AppleSingle/MacBinary
     uint16_t            fkNmBks;    // number of blocks
     int                 fkMode;     // mode (kMFSFork*)
     AppleDouble         *fkAppleDouble;
+    void                *fkHeader;  // AppleSingle/MacBinary header
+    uint32_t            fkHdLen;    // header length
+    struct MFSFork      *fkPart[2]; // AppleSingle/MacBinary data and resource forks
+    uint32_t            fkPartOff[2]; // offset of each fork in the stream
+    int                 fkAdvice;   // kMFSAdviseNormal, Sequential or Random
+    size_t              fkRaOff;    // end of read ahead for sequential reads
+    size_t              fkDropOff;  // end of what's been dropped from the cache
     unsigned long       fkOffset;   // mfs_fkseek, mfs_fkread
     uint16_t            fkAlMap[];  // allocation map
 };
 typedef struct MFSFork MFSFork;
 
+// part of a fork, see mfs_fksegments
+struct MFSForkSegment {
+    const void  *data;      // in memory, or NULL if it has to be read from the image
+    uint64_t    offset;     // offset in the image (not the volume), unless it's a header
+    size_t      length;
+};
+typedef struct MFSForkSegment MFSForkSegment;
+
+// resource in a resource fork
+struct MFSResource {
+    uint32_t    type;
+    int16_t     id;
+    uint8_t     attrs;
+    uint32_t    offset;     // offset of data in the fork
+    uint32_t    length;     // use mfs_res_length, it's read when needed
+    const char  *name;      // MacRoman C string, or NULL
+};
+typedef struct MFSResource MFSResource;
+
+struct MFSResourceType {
+    uint32_t    type;
+    MFSResource *first;
+    size_t      count;
+};
+typedef struct MFSResourceType MFSResourceType;
+
+// resource fork indexed by type and ID, see mfs_res_open
+struct MFSResourceFile {
+    MFSFork         *fork;
+    size_t          count;
+    MFSResource     *res;       // grouped by type
+    size_t          numTypes;
+    MFSResourceType *types;
+    uint32_t        *hash;      // indexes into res + 1 by type and ID, 0 is an empty slot
+    size_t          hashSize;
+};
+typedef struct MFSResourceFile MFSResourceFile;
+
+// kinds of mfs_search pattern
+enum {
+    kMFSSearchSubstring,
+    kMFSSearchPrefix,
+    kMFSSearchGlob      // * and ? wildcards
+};
+
+// filename search, names are compared case-insensitively
+struct MFSSearch {
+    int         kind;       // kMFSSearch*
+    const char  *pattern;   // MacRoman C string, NULL or "" matches any name
+    uint32_t    type;       // file type, 0 for any
+    uint32_t    creator;    // file creator, 0 for any
+};
+typedef struct MFSSearch MFSSearch;
+
+// return nonzero to stop searching
+typedef int (*MFSSearchCallback)(void *ctx, MFSVolume *vol, MFSDirectoryRecord *rec);
+
+// kinds of change in mfs_diff
+enum {
+    kMFSDiffAdded,
+    kMFSDiffRemoved,
+    kMFSDiffRenamed,    // possibly modified too, see what
+    kMFSDiffModified,   // fork contents changed
+    kMFSDiffMetadata    // only the directory record changed
+};
+
+// what changed in a file, for kMFSDiffRenamed, kMFSDiffModified and kMFSDiffMetadata
+enum {
+    kMFSDiffName        = 0x01,
+    kMFSDiffFlags       = 0x02,     // flFlags
+    kMFSDiffDates       = 0x04,
+    kMFSDiffFinderInfo  = 0x08,
+    kMFSDiffDataLayout  = 0x10,     // data fork resized or moved
+    kMFSDiffRsrcLayout  = 0x20,
+    kMFSDiffData        = 0x40,     // data fork contents
+    kMFSDiffRsrc        = 0x80,
+    kMFSDiffUnreadable  = 0x100     // a fork couldn't be read, and is reported as changed
+};
+
+struct MFSChange {
+    int                 kind;   // kMFSDiff*
+    int                 what;   // kMFSDiffName...kMFSDiffUnreadable bits
+    MFSDirectoryRecord  *from;  // NULL if added
+    MFSDirectoryRecord  *to;    // NULL if removed
+};
+typedef struct MFSChange MFSChange;
+
+// directory records as parallel arrays in host endianness, see mfs_columns
+struct MFSDirectoryColumns {
+    size_t      count;
+    uint32_t    *flNum;
+    int16_t     *folder;
+    uint32_t    *type;
+    uint32_t    *creator;
+    uint16_t    *stBlk;
+    uint16_t    *rStBlk;
+    uint32_t    *lgLen;
+    uint32_t    *rLgLen;
+    uint32_t    *crDat;
+    uint32_t    *mdDat;
+    uint32_t    *nameOff;   // offset of each name in names, count+1 entries
+    char        *names;     // MacRoman C strings
+};
+typedef struct MFSDirectoryColumns MFSDirectoryColumns;
+
+// allocation of a file, see mfs_alloc_report
+struct MFSFileExtents {
+    MFSDirectoryRecord  *rec;
+    size_t              dataBlocks;     // allocation blocks
+    size_t              dataExtents;    // contiguous runs of blocks
+    size_t              rsrcBlocks;
+    size_t              rsrcExtents;
+};
+typedef struct MFSFileExtents MFSFileExtents;
+
+struct MFSAllocReport {
+    size_t          numBlocks;          // allocation blocks on volume
+    size_t          freeBlocks;
+    size_t          numFreeRuns;
+    size_t          largestFree;        // longest run of free blocks
+    uint16_t        largestFreeStart;   // first block of it
+    size_t          numForks;           // non-empty forks
+    size_t          fragmentedForks;    // forks with more than one extent
+    size_t          numExtents;
+    double          avgExtentLength;    // in allocation blocks
+    size_t          numFiles;
+    MFSFileExtents  *files;             // in directory order
+};
+typedef struct MFSAllocReport MFSAllocReport;
+
 #define kAppleDoubleHeaderLength        0x300
 #define kAppleDoubleResourceForkOffset  kAppleDoubleHeaderLength
 #define kAppleDoubleFinderInfoOffset    0x70
 #define kAppleDoubleFinderInfoLength    0x20
+#define kAppleDoubleCommentOffset       0x90    // up to 255 bytes
 
 // open/close volume
 MFSVolume* mfs_vopen (const char *path, size_t offset, int flags);
+MFSVolume* mfs_vopen_fd (int fd, size_t offset, int flags);
+MFSVolume* mfs_vopen_mem (const void *data, size_t size, size_t offset, int flags);
+MFSVolume* mfs_vopen_alloc (const char *path, size_t offset, int flags, const MFSAllocator *alloc);
+MFSVolume* mfs_vopen_source (const MFSBlockSource *src, size_t offset, int flags, const MFSAllocator *alloc);
+int mfs_source_fd (MFSBlockSource *src, int fd, int owned, const MFSAllocator *alloc);
+int mfs_source_mem (MFSBlockSource *src, const void *data, size_t size, const MFSAllocator *alloc);
 int mfs_vclose (MFSVolume* vol);
+size_t mfs_vmemory (MFSVolume *vol);
+
+// sidecar index
+int mfs_index_write (MFSVolume *vol, const char *path);
+
+// columnar directory: masks have a byte per record, nonzero to keep it; filters only clear
+// records and leave 0 or 1, and indexes only needs room for the records that are kept
+MFSDirectoryColumns* mfs_columns (MFSVolume *vol);
+size_t mfs_columns_eq16 (const int16_t *col, size_t count, int16_t value, uint8_t *mask);
+size_t mfs_columns_eq32 (const uint32_t *col, size_t count, uint32_t value, uint8_t *mask);
+size_t mfs_columns_range32 (const uint32_t *col, size_t count, uint32_t min, uint32_t max, uint8_t *mask);
+uint64_t mfs_columns_sum32 (const uint32_t *col, size_t count, const uint8_t *mask);
+size_t mfs_columns_indexes (const uint8_t *mask, size_t count, uint32_t *indexes);
+
+// allocation
+ssize_t mfs_vfree (MFSVolume *vol, uint16_t first, size_t count);
+int mfs_alblk_used (MFSVolume *vol, uint16_t alBk);
+MFSAllocReport* mfs_alloc_report (MFSVolume *vol);
+void mfs_alloc_report_free (MFSAllocReport *report);
+int mfs_defrag (MFSVolume *vol, int fd); // truncates fd first, it must be a regular file
+
+// export
+int mfs_tar (MFSVolume *vol, int fd, int flags);
+
+// compare volumes
+MFSChange* mfs_diff (MFSVolume *v1, MFSVolume *v2, int flags, size_t *count);
+void mfs_diff_free (MFSChange *changes);
+
+// convert names, ':' and '/' are swapped in UTF-8
+size_t mfs_utf8_from_macroman (char *dst, size_t size, const char *src);
+ssize_t mfs_macroman_from_utf8 (char *dst, size_t size, const char *src);
+const char * mfs_utf8name (MFSDirectoryRecord *rec);
 
 // convert time
 time_t mfs_time (uint32_t mfsDate);
@@ -197,11 +451,15 @@ struct timespec mfs_timespec (uint32_t mfsDate);
 MFSDirectoryRecord ** mfs_directory (MFSVolume *vol);
 void mfs_directory_free (MFSDirectoryRecord ** dir);
 MFSDirectoryRecord* mfs_directory_find_name (MFSDirectoryRecord **dir, const char *name);
+MFSDirectoryRecord* mfs_directory_lookup (MFSVolume *vol, const char *name);
 char * mfs_comment (MFSVolume *vol, MFSDirectoryRecord *rec);
+MFSDirectoryRecord* mfs_directory_lookup_utf8 (MFSVolume *vol, const char *name);
+ssize_t mfs_search (MFSVolume **vols, size_t numVols, const MFSSearch *search, MFSSearchCallback callback, void *ctx);
 
 // folders
 MFSFolder* mfs_folder_find (MFSVolume *vol, int16_t fdID);
 MFSFolder* mfs_folder_find_name (MFSVolume *vol, const char *name);
+MFSFolder* mfs_folder_find_utf8name (MFSVolume *vol, const char *name);
 int mfs_path_info (MFSVolume *vol, const char *path);
 
 // fork mgmt
@@ -209,6 +467,23 @@ MFSFork* mfs_fkopen (MFSVolume *vol, MFSDirectoryRecord *rec, int mode, int flag
 MFSFork* mfs_dhopen (MFSVolume *vol, MFSFolder *folder);
 int mfs_fkclose (MFSFork *fk);
 int mfs_fkread_at (MFSFork *fk, size_t size, size_t offset, void *buf);
+size_t mfs_fksize (MFSFork *fk);
+int mfs_fkadvise (MFSFork *fk, size_t size, size_t offset, int advice);
+int mfs_vadvise (MFSVolume *vol, int advice);
+
+// zero-copy access: segments can be written with writev or spliced from mfs_vfileno
+ssize_t mfs_fksegments (MFSFork *fk, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs);
+int mfs_vfileno (MFSVolume *vol);
+
+// resources
+MFSResourceFile* mfs_res_open (MFSFork *fk);
+int mfs_res_close (MFSResourceFile *rf);
+MFSResource* mfs_res_find (MFSResourceFile *rf, uint32_t type, int16_t id);
+MFSResource* mfs_res_list (MFSResourceFile *rf, uint32_t type, size_t *count);
+uint32_t mfs_res_length (MFSResourceFile *rf, MFSResource *res);
+int mfs_res_read (MFSResourceFile *rf, MFSResource *res, size_t size, size_t offset, void *buf);
+ssize_t mfs_res_segments (MFSResourceFile *rf, MFSResource *res, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs);
+MFSResourceFile* mfs_desktop (MFSVolume *vol);
 
 // for librsrc/libres compatibility
 unsigned long mfs_fkread (void *fk, void *buf, unsigned long length);
@@ -0,0 +1,139 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Volume memory: everything a volume keeps until it's closed (the volume
+// itself, VABM, directory, folders, hashes, columns) is carved out of large
+// chunks that mfs_vclose gives back all at once. Forks, headers and buffers
+// that come and go are allocated one by one. Both come from the volume's
+// allocator, and are counted in mfs_vmemory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSArenaChunk      (64*1024)
+#define kMFSArenaAlign      32
+// before each allocation made with mfs_malloc, keeps alignment
+#define kMFSAllocHeader     16
+
+struct MFSArenaChunk {
+    struct MFSArenaChunk    *next;
+    size_t                  size;   // as passed to the allocator
+};
+
+// private functions
+void * mfs_default_alloc (void *ctx, size_t size);
+void mfs_default_free (void *ctx, void *ptr, size_t size);
+void * mfs_arena_chunk (MFSVolume *vol, size_t size);
+
+void * mfs_default_alloc (void *ctx, size_t size) {
+    return malloc(size);
+}
+
+void mfs_default_free (void *ctx, void *ptr, size_t size) {
+    free(ptr);
+}
+
+const MFSAllocator mfs_allocator_default = {NULL, mfs_default_alloc, mfs_default_free};
+
+// new chunk with room for size bytes after aligning, not yet linked
+void * mfs_arena_chunk (MFSVolume *vol, size_t size) {
+    size_t chunkSize = sizeof(struct MFSArenaChunk) + kMFSArenaAlign + size;
+    if (chunkSize < size) {errno = ENOMEM; return NULL;}
+    struct MFSArenaChunk *chunk = vol->alloc.alloc(vol->alloc.ctx, chunkSize);
+    if (chunk == NULL) return NULL;
+    chunk->size = chunkSize;
+    __sync_fetch_and_add(&vol->memory, chunkSize);
+    return chunk;
+}
+
+// zeroed memory that lasts until the volume is closed, aligned to 32 bytes
+// not thread safe: callers are opening the volume, or hold vol->lock
+void * mfs_arena_alloc (MFSVolume *vol, size_t size) {
+    struct MFSArenaChunk *chunk;
+    uintptr_t p = mfs_round((uintptr_t)vol->arenaPos, kMFSArenaAlign);
+    size = mfs_round(size, kMFSArenaAlign);
+
+    if (vol->arenaPos && p + size <= (uintptr_t)vol->arenaEnd) {
+        vol->arenaPos = (void*)(p + size);
+    } else if (size > kMFSArenaChunk/4) {
+        // big allocations get a chunk of their own, the current one stays in use
+        if ((chunk = mfs_arena_chunk(vol, size)) == NULL) return NULL;
+        struct MFSArenaChunk *head = vol->arena;
+        chunk->next = head? head->next : NULL;
+        if (head) head->next = chunk;
+        else vol->arena = chunk;
+        p = mfs_round((uintptr_t)(chunk + 1), kMFSArenaAlign);
+    } else {
+        if ((chunk = mfs_arena_chunk(vol, kMFSArenaChunk)) == NULL) return NULL;
+        chunk->next = vol->arena;
+        vol->arena = chunk;
+        vol->arenaEnd = (void*)chunk + chunk->size;
+        p = mfs_round((uintptr_t)(chunk + 1), kMFSArenaAlign);
+        vol->arenaPos = (void*)(p + size);
+    }
+    memset((void*)p, 0, size);
+    return (void*)p;
+}
+
+// gives back every chunk, including the one the volume is in
+void mfs_arena_release (MFSVolume *vol) {
+    MFSAllocator alloc = vol->alloc;
+    struct MFSArenaChunk *chunk = vol->arena, *next;
+    while (chunk) {
+        next = chunk->next;
+        alloc.free(alloc.ctx, chunk, chunk->size);
+        chunk = next;
+    }
+}
+
+void * mfs_malloc (MFSVolume *vol, size_t size) {
+    if (size + kMFSAllocHeader < size) {errno = ENOMEM; return NULL;}
+    size_t *p = vol->alloc.alloc(vol->alloc.ctx, size + kMFSAllocHeader);
+    if (p == NULL) return NULL;
+    *p = size + kMFSAllocHeader;
+    __sync_fetch_and_add(&vol->memory, *p);
+    return (void*)p + kMFSAllocHeader;
+}
+
+void * mfs_calloc (MFSVolume *vol, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {errno = ENOMEM; return NULL;}
+    void *p = mfs_malloc(vol, count*size);
+    if (p) memset(p, 0, count*size);
+    return p;
+}
+
+void mfs_free (MFSVolume *vol, void *ptr) {
+    if (ptr == NULL) return;
+    size_t *p = ptr - kMFSAllocHeader;
+    size_t size = *p;
+    __sync_fetch_and_sub(&vol->memory, size);
+    vol->alloc.free(vol->alloc.ctx, p, size);
+}
+
+// bytes the volume has from its allocator: arena chunks, open forks and buffers in use
+// the sidecar index is mapped from its file, and isn't counted
+size_t mfs_vmemory (MFSVolume *vol) {
+    if (vol == NULL) {errno = EINVAL; return 0;}
+    return __sync_add_and_fetch(&vol->memory, 0);
+}
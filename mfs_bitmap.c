@@ -0,0 +1,154 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Allocation bitmap: one bit per allocation block, set if it's used, made
+// from the VABM the first time it's needed. Bit 0 is allocation block 2, and
+// bits past the end of the volume are set so they never count as free.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+// private functions
+uint64_t * mfs_bitmap (MFSVolume *vol);
+size_t mfs_bitmap_extents (MFSVolume *vol, uint16_t alBk, uint32_t pyLen, size_t *numBlocks);
+
+uint64_t * mfs_bitmap (MFSVolume *vol) {
+    // allocBits is published once filled, so the lock is only taken to build
+    uint64_t *bits = __atomic_load_n(&vol->allocBits, __ATOMIC_ACQUIRE);
+    if (bits) return bits;
+    pthread_mutex_lock(&vol->lock);
+    bits = vol->allocBits;
+    if (bits == NULL) {
+        size_t numBlocks = vol->mdb.drNmAlBlks;
+        size_t numWords = (numBlocks + 63) / 64;
+        bits = mfs_arena_alloc(vol, (numWords? numWords : 1)*sizeof(uint64_t));
+        if (bits) {
+            for(size_t n=0; n < numBlocks; n++)
+                if (vol->vabm[n+2]) bits[n/64] |= 1ull << (n%64);
+            if (numBlocks % 64) bits[numWords-1] |= ~0ull << (numBlocks % 64);
+            __atomic_store_n(&vol->allocBits, bits, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&vol->lock);
+    return bits;
+}
+
+// number of contiguous runs in a fork's allocation chain
+size_t mfs_bitmap_extents (MFSVolume *vol, uint16_t alBk, uint32_t pyLen, size_t *numBlocks) {
+    size_t count = pyLen / vol->mdb.drAlBlkSiz, extents = 0, n;
+    uint16_t prev = 0;
+    for(n=0; n < count && alBk >= 2 && alBk < vol->mdb.drNmAlBlks+2; n++) {
+        if (alBk != prev+1) extents++;
+        prev = alBk;
+        alBk = vol->vabm[alBk];
+    }
+    *numBlocks = n;
+    return extents;
+}
+
+// number of free allocation blocks in [first, first+count)
+ssize_t mfs_vfree (MFSVolume *vol, uint16_t first, size_t count) {
+    uint64_t *bits = mfs_bitmap(vol);
+    if (bits == NULL) return -1;
+    if (first < 2 || first - 2 > vol->mdb.drNmAlBlks) {errno = EINVAL; return -1;}
+    size_t start = first - 2;
+    size_t end = start + count;
+    if (end > vol->mdb.drNmAlBlks) end = vol->mdb.drNmAlBlks;
+    if (start >= end) return 0;
+
+    size_t used = 0, w = start / 64, lastWord = (end-1) / 64;
+    uint64_t firstMask = ~0ull << (start % 64);
+    uint64_t lastMask = (end % 64)? ~0ull >> (64 - end % 64) : ~0ull;
+    if (w == lastWord) return (end - start) - __builtin_popcountll(bits[w] & firstMask & lastMask);
+    used += __builtin_popcountll(bits[w++] & firstMask);
+    for(; w < lastWord; w++) used += __builtin_popcountll(bits[w]);
+    used += __builtin_popcountll(bits[w] & lastMask);
+    return (end - start) - used;
+}
+
+// 1 if an allocation block is in use, 0 if it's free, -1 on error
+int mfs_alblk_used (MFSVolume *vol, uint16_t alBk) {
+    uint64_t *bits = mfs_bitmap(vol);
+    if (bits == NULL) return -1;
+    if (alBk < 2 || alBk >= vol->mdb.drNmAlBlks+2) {errno = EINVAL; return -1;}
+    return (bits[(alBk-2)/64] >> ((alBk-2)%64)) & 1;
+}
+
+MFSAllocReport* mfs_alloc_report (MFSVolume *vol) {
+    uint64_t *bits = mfs_bitmap(vol);
+    if (bits == NULL) return NULL;
+    size_t numFiles;
+    for(numFiles=0; vol->directory[numFiles]; numFiles++);
+    MFSAllocReport *report = calloc(1, sizeof(MFSAllocReport) + sizeof(MFSFileExtents)*numFiles);
+    if (report == NULL) return NULL;
+    report->numBlocks = vol->mdb.drNmAlBlks;
+    report->numFiles = numFiles;
+    report->files = (MFSFileExtents*)(report + 1);
+
+    // free runs, a word at a time when it's all used or all free
+    size_t run = 0, numWords = (report->numBlocks + 63) / 64;
+    for(size_t w=0; w <= numWords; w++) {
+        uint64_t word = (w < numWords)? bits[w] : ~0ull;
+        if (word == 0) {
+            run += 64;
+            continue;
+        }
+        for(int b=0; b < 64; b++) {
+            if ((word >> b) & 1) {
+                if (run) {
+                    report->numFreeRuns++;
+                    report->freeBlocks += run;
+                    if (run > report->largestFree) {
+                        report->largestFree = run;
+                        report->largestFreeStart = w*64 + b - run + 2;
+                    }
+                }
+                run = 0;
+                if (word == ~0ull) break;
+            } else run++;
+        }
+    }
+
+    // extents of each fork
+    size_t forkBlocks = 0, numBlocks;
+    for(size_t i=0; i < numFiles; i++) {
+        MFSDirectoryRecord *rec = vol->directory[i];
+        MFSFileExtents *fe = &report->files[i];
+        fe->rec = rec;
+        fe->dataExtents = mfs_bitmap_extents(vol, rec->flStBlk, rec->flPyLen, &numBlocks);
+        fe->dataBlocks = numBlocks;
+        fe->rsrcExtents = mfs_bitmap_extents(vol, rec->flRStBlk, rec->flRPyLen, &numBlocks);
+        fe->rsrcBlocks = numBlocks;
+        forkBlocks += fe->dataBlocks + fe->rsrcBlocks;
+        report->numExtents += fe->dataExtents + fe->rsrcExtents;
+        report->numForks += (fe->dataBlocks? 1 : 0) + (fe->rsrcBlocks? 1 : 0);
+        report->fragmentedForks += (fe->dataExtents > 1? 1 : 0) + (fe->rsrcExtents > 1? 1 : 0);
+    }
+    report->avgExtentLength = report->numExtents? (double)forkBlocks / report->numExtents : 0.0;
+    return report;
+}
+
+void mfs_alloc_report_free (MFSAllocReport *report) {
+    // files are allocated along with the report
+    free(report);
+}
@@ -0,0 +1,133 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Columnar directory: each field of the directory records in its own array,
+// in host endianness, so scans only touch the fields they use. Filters narrow
+// a byte mask with one entry per record, in loops simple enough for the
+// compiler to vectorize.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSColumnAlign     32
+#define kMFSColumnSize(n)   mfs_round((n), kMFSColumnAlign)
+
+// all columns in one allocation, each one aligned for vector loads
+// the volume's arena is aligned to kMFSColumnAlign
+int mfs_columns_build (MFSVolume *vol) {
+    size_t count, namesLen = 0;
+    for(count = 0; vol->directory[count]; count++) namesLen += vol->directory[count]->flNam[0] + 1;
+    size_t size16 = kMFSColumnSize(sizeof(uint16_t)*count);
+    size_t size32 = kMFSColumnSize(sizeof(uint32_t)*count);
+    size_t size = kMFSColumnSize(sizeof(MFSDirectoryColumns)) + 3*size16 + 7*size32 + kMFSColumnSize(sizeof(uint32_t)*(count+1)) + namesLen;
+    void *p = mfs_arena_alloc(vol, size);
+    if (p == NULL) return -1;
+
+    MFSDirectoryColumns *cols = p;
+    p += kMFSColumnSize(sizeof(MFSDirectoryColumns));
+    cols->count = count;
+    cols->folder = p;   p += size16;
+    cols->stBlk = p;    p += size16;
+    cols->rStBlk = p;   p += size16;
+    cols->flNum = p;    p += size32;
+    cols->type = p;     p += size32;
+    cols->creator = p;  p += size32;
+    cols->lgLen = p;    p += size32;
+    cols->rLgLen = p;   p += size32;
+    cols->crDat = p;    p += size32;
+    cols->mdDat = p;    p += size32;
+    cols->nameOff = p;  p += kMFSColumnSize(sizeof(uint32_t)*(count+1));
+    cols->names = p;
+
+    size_t nameOff = 0;
+    for(size_t i=0; i < count; i++) {
+        MFSDirectoryRecord *rec = vol->directory[i];
+        cols->folder[i]  = ntohs(rec->flUsrWds.folder);
+        cols->stBlk[i]   = rec->flStBlk;
+        cols->rStBlk[i]  = rec->flRStBlk;
+        cols->flNum[i]   = rec->flFlNum;
+        cols->type[i]    = ntohl(rec->flUsrWds.type);
+        cols->creator[i] = ntohl(rec->flUsrWds.creator);
+        cols->lgLen[i]   = rec->flLgLen;
+        cols->rLgLen[i]  = rec->flRLgLen;
+        cols->crDat[i]   = rec->flCrDat;
+        cols->mdDat[i]   = rec->flMdDat;
+        cols->nameOff[i] = nameOff;
+        memcpy(cols->names + nameOff, rec->flCName, rec->flNam[0] + 1);
+        nameOff += rec->flNam[0] + 1;
+    }
+    cols->nameOff[count] = nameOff;
+    vol->columns = cols;
+    return 0;
+}
+
+MFSDirectoryColumns* mfs_columns (MFSVolume *vol) {
+    if (vol->columns == NULL) errno = ENOMEM;
+    return vol->columns;
+}
+
+// the filters keep records in mask that match, and return how many are left
+size_t mfs_columns_eq16 (const int16_t *col, size_t count, int16_t value, uint8_t *mask) {
+    size_t n = 0;
+    for(size_t i=0; i < count; i++) {
+        mask[i] &= (col[i] == value);
+        n += mask[i];
+    }
+    return n;
+}
+
+size_t mfs_columns_eq32 (const uint32_t *col, size_t count, uint32_t value, uint8_t *mask) {
+    size_t n = 0;
+    for(size_t i=0; i < count; i++) {
+        mask[i] &= (col[i] == value);
+        n += mask[i];
+    }
+    return n;
+}
+
+// min <= value <= max
+size_t mfs_columns_range32 (const uint32_t *col, size_t count, uint32_t min, uint32_t max, uint8_t *mask) {
+    size_t n = 0;
+    for(size_t i=0; i < count; i++) {
+        mask[i] &= (col[i] >= min) & (col[i] <= max);
+        n += mask[i];
+    }
+    return n;
+}
+
+// sum of a column over the records in mask, or all of them if mask is NULL
+uint64_t mfs_columns_sum32 (const uint32_t *col, size_t count, const uint8_t *mask) {
+    uint64_t sum = 0;
+    if (mask == NULL) for(size_t i=0; i < count; i++) sum += col[i];
+    else for(size_t i=0; i < count; i++) sum += (uint64_t)col[i] * (mask[i] != 0);
+    return sum;
+}
+
+// indexes of the records in mask, returns how many
+size_t mfs_columns_indexes (const uint8_t *mask, size_t count, uint32_t *indexes) {
+    size_t n = 0;
+    for(size_t i=0; i < count; i++)
+        if (mask[i]) indexes[n++] = i;
+    return n;
+}
@@ -0,0 +1,213 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Defragmenting copy: writes a volume to a new image with every fork in one
+// contiguous run, in folder order, so reading all the files back is a single
+// pass over the image. Everything else (boot blocks, MDB, directory) is copied
+// as it is, except for the VABM, the free block count and the start blocks in
+// directory records.
+
+// pwrite and ftruncate aren't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSDefragBufferBlocks  64
+
+// private functions
+size_t mfs_defrag_order (MFSVolume *vol, int16_t folder, size_t *order, size_t count, uint8_t *done, uint8_t *visited);
+int mfs_defrag_fork (MFSVolume *vol, int fd, uint16_t srcBk, uint32_t pyLen, MFSVABM vabm, uint16_t *next, uint16_t *start, uint8_t *buf);
+int mfs_pwrite (int fd, const void *buf, size_t size, off_t offset);
+
+int mfs_pwrite (int fd, const void *buf, size_t size, off_t offset) {
+    while (size) {
+        ssize_t w = pwrite(fd, buf, size, offset);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        size -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// appends files in a folder and then its subfolders, depth first
+size_t mfs_defrag_order (MFSVolume *vol, int16_t folder, size_t *order, size_t count, uint8_t *done, uint8_t *visited) {
+    for(size_t i=0; vol->directory[i]; i++) {
+        if (done[i] || (int16_t)ntohs(vol->directory[i]->flUsrWds.folder) != folder) continue;
+        done[i] = 1;
+        order[count++] = i;
+    }
+    for(size_t f=0; f < vol->numFolders; f++) {
+        if (visited[f] || vol->folders[f].fdParent != folder || vol->folders[f].fdID == folder) continue;
+        visited[f] = 1;
+        count = mfs_defrag_order(vol, vol->folders[f].fdID, order, count, done, visited);
+    }
+    return count;
+}
+
+// copies a fork to blocks from *next on, skipping blocks reserved in the VABM
+int mfs_defrag_fork (MFSVolume *vol, int fd, uint16_t srcBk, uint32_t pyLen, MFSVABM vabm, uint16_t *next, uint16_t *start, uint8_t *buf) {
+    size_t numBlocks = pyLen / vol->mdb.drAlBlkSiz;
+    size_t alBkSize = vol->mdb.drAlBlkSiz;
+    uint16_t lastBk = vol->mdb.drNmAlBlks + 2;
+    uint16_t prevDst = 0;
+    *start = 0;
+
+    while (numBlocks) {
+        // run that's contiguous in both images
+        uint16_t runSrc = srcBk, runDst = 0;
+        size_t runLen = 0;
+        while (numBlocks && runLen < kMFSDefragBufferBlocks) {
+            while (*next < lastBk && vol->vabm[*next] == kMFSAlBkDir) (*next)++;
+            if (*next >= lastBk || srcBk < 2 || srcBk >= lastBk) {errno = EINVAL; return -1;}
+            if (runLen && (srcBk != runSrc + runLen || *next != runDst + runLen)) break;
+            if (runLen == 0) runDst = *next;
+            if (prevDst) vabm[prevDst] = *next;
+            else *start = *next;
+            prevDst = *next;
+            vabm[prevDst] = kMFSAlBkLast;
+            runLen++;
+            numBlocks--;
+            (*next)++;
+            srcBk = vol->vabm[srcBk];
+        }
+        if (-1 == mfs_albkread(vol, runLen, runSrc, buf)) return -1;
+        if (-1 == mfs_pwrite(fd, buf, runLen*alBkSize, vol->alBkOff + (off_t)alBkSize*runDst)) return -1;
+    }
+    return 0;
+}
+
+// writes a defragmented copy of the volume to fd, at offset 0
+int mfs_defrag (MFSVolume *vol, int fd) {
+    uint8_t *sys = NULL, *buf = NULL, *done = NULL;
+    size_t *order = NULL;
+    uint16_t *starts = NULL;
+    MFSVABM vabm = NULL;
+    if (vol == NULL || fd < 0) {errno = EINVAL; return -1;}
+    MFSMasterDirectoryBlock *mdb = &vol->mdb;
+    size_t numRecords, numBlocks = mdb->drNmAlBlks;
+    size_t alBkSize = mdb->drAlBlkSiz;
+    for(numRecords=0; vol->directory[numRecords]; numRecords++);
+    // everything before the allocation blocks is copied with changes
+    if (mdb->drDirSt + mdb->drBlLen > mdb->drAlBlSt ||
+        2*kMFSBlockSize + sizeof(MFSMasterDirectoryBlock) + (numBlocks*3+1)/2 > kMFSBlockSize*mdb->drAlBlSt) {errno = EINVAL; return -1;}
+
+    sys = mfs_malloc(vol, kMFSBlockSize*mdb->drAlBlSt);
+    buf = mfs_malloc(vol, alBkSize*kMFSDefragBufferBlocks);
+    order = mfs_calloc(vol, numRecords+1, sizeof(size_t));
+    done = mfs_calloc(vol, numRecords + vol->numFolders + 1, 1);
+    starts = mfs_calloc(vol, 2*numRecords+1, sizeof(uint16_t));
+    vabm = mfs_calloc(vol, numBlocks+2, sizeof(uint16_t));
+    if (!sys || !buf || !order || !done || !starts || !vabm) goto error;
+    if (-1 == mfs_blkread(vol, mdb->drAlBlSt, 0, sys)) goto error;
+    // free blocks are left as holes, so they're only zeros in an empty file
+    if (-1 == ftruncate(fd, 0)) goto error;
+
+    // order files by folder, anything not in a known folder goes last
+    size_t count = 0;
+    uint8_t *visited = done + numRecords;
+    count = mfs_defrag_order(vol, kMFSFolderRoot, order, count, done, visited);
+    count = mfs_defrag_order(vol, kMFSFolderDesktop, order, count, done, visited);
+    count = mfs_defrag_order(vol, kMFSFolderTrash, order, count, done, visited);
+    for(size_t i=0; i < numRecords; i++) if (!done[i]) order[count++] = i;
+
+    // reserved blocks stay where they are, then copy forks around them
+    uint16_t next = 2;
+    for(size_t n=2; n < numBlocks+2; n++) {
+        if (vol->vabm[n] != kMFSAlBkDir) continue;
+        vabm[n] = kMFSAlBkDir;
+        if (-1 == mfs_albkread(vol, 1, n, buf) ||
+            -1 == mfs_pwrite(fd, buf, alBkSize, vol->alBkOff + (off_t)alBkSize*n)) goto error;
+    }
+    for(size_t k=0; k < count; k++) {
+        size_t i = order[k];
+        MFSDirectoryRecord *rec = vol->directory[i];
+        if (-1 == mfs_defrag_fork(vol, fd, rec->flStBlk, rec->flPyLen, vabm, &next, &starts[2*i], buf)) goto error;
+        if (-1 == mfs_defrag_fork(vol, fd, rec->flRStBlk, rec->flRPyLen, vabm, &next, &starts[2*i+1], buf)) goto error;
+    }
+
+    // new start blocks, records are in the same order as vol->directory
+    uint8_t *dir = sys + kMFSBlockSize*mdb->drDirSt;
+    size_t recCount = 0;
+    for(size_t block = 0; block < mdb->drBlLen && recCount < numRecords; block++) {
+        size_t recOffset = 0;
+        while (recOffset + 51 <= kMFSBlockSize && recCount < numRecords) {
+            MFSDirectoryRecord *rec = (MFSDirectoryRecord*)(dir + kMFSBlockSize*block + recOffset);
+            size_t recSize = 51 + rec->flNam[0];
+            if (rec->flFlags == 0 || recOffset + recSize > kMFSBlockSize) break;
+            rec->flStBlk = htons(starts[2*recCount]);
+            rec->flRStBlk = htons(starts[2*recCount+1]);
+            recCount++;
+            recOffset += recSize + (recSize%2);
+        }
+    }
+
+    // pack VABM after MDB
+    uint8_t *packed = sys + 2*kMFSBlockSize + sizeof(MFSMasterDirectoryBlock);
+    for(size_t n=0; n < numBlocks; n++) {
+        uint8_t *p = packed + (n*3)/2;
+        uint16_t val = vabm[n+2];
+        if (n%2) {
+            p[0] = (p[0] & 0xF0) | (val >> 8);
+            p[1] = val & 0xFF;
+        } else {
+            p[0] = val >> 4;
+            p[1] = (p[1] & 0x0F) | ((val & 0xF) << 4);
+        }
+    }
+
+    // blocks that were orphaned or cross-linked are free now
+    uint16_t freeBks = 0;
+    for(size_t n=2; n < numBlocks+2; n++) if (vabm[n] == 0) freeBks++;
+    ((MFSMasterDirectoryBlock*)(sys + 2*kMFSBlockSize))->drFreeBks = htons(freeBks);
+    if (-1 == mfs_pwrite(fd, sys, kMFSBlockSize*mdb->drAlBlSt, 0)) goto error;
+
+    // anything after the allocation blocks, and free blocks are zeros
+    off_t alEnd = vol->alBkOff + (off_t)alBkSize*(numBlocks+2);
+    off_t volEnd = vol->src.size? (off_t)(vol->src.size(vol->src.ctx) - vol->offset) : alEnd;
+    for(off_t off = alEnd; off < volEnd; off += kMFSBlockSize) {
+        size_t len = (volEnd - off < kMFSBlockSize)? volEnd - off : kMFSBlockSize;
+        if (-1 == mfs_read_at(vol, buf, len, off) || -1 == mfs_pwrite(fd, buf, len, off)) goto error;
+    }
+    if (-1 == ftruncate(fd, volEnd > alEnd? volEnd : alEnd)) goto error;
+
+    mfs_free(vol, sys);
+    mfs_free(vol, buf);
+    mfs_free(vol, order);
+    mfs_free(vol, done);
+    mfs_free(vol, starts);
+    mfs_free(vol, vabm);
+    return 0;
+error:
+    mfs_free(vol, sys);
+    mfs_free(vol, buf);
+    mfs_free(vol, order);
+    mfs_free(vol, done);
+    mfs_free(vol, starts);
+    mfs_free(vol, vabm);
+    return -1;
+}
@@ -0,0 +1,199 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Volume diff: files are matched by file number, then by name, and compared
+// by their directory records. Fork contents are only read when the records
+// can't tell: same length, but moved or with a different modification date.
+// A fork that can't be read is reported as changed, and the diff goes on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSDiffBufferSize  65536
+
+// private functions
+int mfs_diff_extents_eq (MFSVolume *v1, uint16_t bk1, MFSVolume *v2, uint16_t bk2, uint32_t pyLen);
+int mfs_diff_fork (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int mode, int flags, uint8_t *buf);
+int mfs_diff_contents_eq (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int mode, uint8_t *buf);
+int mfs_diff_record (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int flags, uint8_t *buf);
+
+// same allocation blocks in the same order, at the same place in the image
+int mfs_diff_extents_eq (MFSVolume *v1, uint16_t bk1, MFSVolume *v2, uint16_t bk2, uint32_t pyLen) {
+    if (v1->mdb.drAlBlkSiz != v2->mdb.drAlBlkSiz || v1->offset + v1->alBkOff != v2->offset + v2->alBkOff) return 0;
+    for(uint32_t n = pyLen / v1->mdb.drAlBlkSiz; n; n--) {
+        if (bk1 != bk2) return 0;
+        if (bk1 < 2 || bk1 >= v1->mdb.drNmAlBlks+2 || bk2 >= v2->mdb.drNmAlBlks+2) return 0;
+        bk1 = v1->vabm[bk1];
+        bk2 = v2->vabm[bk2];
+    }
+    return 1;
+}
+
+// 1 if the contents are the same, 0 if not, -1 on error
+int mfs_diff_contents_eq (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int mode, uint8_t *buf) {
+    MFSFork *fk1 = mfs_fkopen(v1, r1, mode, 0);
+    MFSFork *fk2 = mfs_fkopen(v2, r2, mode, 0);
+    size_t size = fk1? mfs_fksize(fk1) : 0;
+    int eq = (fk1 && fk2)? 1 : -1;
+    for(size_t offset = 0; eq == 1 && offset < size; offset += kMFSDiffBufferSize) {
+        size_t len = (size - offset < kMFSDiffBufferSize)? size - offset : kMFSDiffBufferSize;
+        if (mfs_fkread_at(fk1, len, offset, buf) != (int)len ||
+            mfs_fkread_at(fk2, len, offset, buf + kMFSDiffBufferSize) != (int)len) eq = -1;
+        else if (memcmp(buf, buf + kMFSDiffBufferSize, len)) eq = 0;
+    }
+    if (fk1) mfs_fkclose(fk1);
+    if (fk2) mfs_fkclose(fk2);
+    return eq;
+}
+
+// kMFSDiff* bits for a fork
+int mfs_diff_fork (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int mode, int flags, uint8_t *buf) {
+    int isRsrc = (mode == kMFSForkRsrc);
+    uint32_t len1 = isRsrc? r1->flRLgLen : r1->flLgLen;
+    uint32_t len2 = isRsrc? r2->flRLgLen : r2->flLgLen;
+    int contents = isRsrc? kMFSDiffRsrc : kMFSDiffData;
+    int what = 0;
+
+    // cheap checks
+    if (len1 != len2) return contents | (isRsrc? kMFSDiffRsrcLayout : kMFSDiffDataLayout);
+    if (len1 == 0) return 0;
+    if ((isRsrc? r1->flRPyLen != r2->flRPyLen : r1->flPyLen != r2->flPyLen) ||
+        !mfs_diff_extents_eq(v1, isRsrc? r1->flRStBlk : r1->flStBlk, v2, isRsrc? r2->flRStBlk : r2->flStBlk, isRsrc? r1->flRPyLen : r1->flPyLen))
+        what |= isRsrc? kMFSDiffRsrcLayout : kMFSDiffDataLayout;
+    if (what == 0 && r1->flMdDat == r2->flMdDat && !(flags & MFS_DIFF_CONTENTS)) return 0;
+
+    // moved or touched, compare contents
+    int eq = mfs_diff_contents_eq(v1, r1, v2, r2, mode, buf);
+    if (eq == -1) return what | contents | kMFSDiffUnreadable;
+    return what | (eq? 0 : contents);
+}
+
+// kMFSDiff* bits for a pair of records
+int mfs_diff_record (MFSVolume *v1, MFSDirectoryRecord *r1, MFSVolume *v2, MFSDirectoryRecord *r2, int flags, uint8_t *buf) {
+    int what = 0;
+    if (strcmp(r1->flCName, r2->flCName)) what |= kMFSDiffName;
+    if (r1->flFlags != r2->flFlags) what |= kMFSDiffFlags;
+    if (r1->flCrDat != r2->flCrDat || r1->flMdDat != r2->flMdDat) what |= kMFSDiffDates;
+    if (memcmp(&r1->flUsrWds, &r2->flUsrWds, sizeof(MFSFInfo))) what |= kMFSDiffFinderInfo;
+    what |= mfs_diff_fork(v1, r1, v2, r2, kMFSForkData, flags, buf);
+    if (r1->flRStBlk == 0 || r2->flRStBlk == 0) {
+        // no resource fork on one side
+        if (r1->flRLgLen != r2->flRLgLen) what |= kMFSDiffRsrc | kMFSDiffRsrcLayout;
+    } else {
+        what |= mfs_diff_fork(v1, r1, v2, r2, kMFSForkRsrc, flags, buf);
+    }
+    return what;
+}
+
+// changes from v1 to v2: removed and changed files in v1's order, then added files in v2's order
+MFSChange* mfs_diff (MFSVolume *v1, MFSVolume *v2, int flags, size_t *count) {
+    MFSChange *changes = NULL;
+    uint32_t *match = NULL, *numHash = NULL;
+    uint8_t *buf = NULL;
+    size_t n1, n2, numChanges = 0;
+    if (v1 == NULL || v2 == NULL || count == NULL) {errno = EINVAL; return NULL;}
+    for(n1 = 0; v1->directory[n1]; n1++);
+    for(n2 = 0; v2->directory[n2]; n2++);
+
+    // v2 indexes by file number, and matches for each v1 record (index + 1)
+    size_t hashSize = 8;
+    while (hashSize < 2*n2) hashSize *= 2;
+    numHash = mfs_calloc(v1, hashSize, sizeof(uint32_t));
+    match = mfs_calloc(v1, n1 + n2, sizeof(uint32_t));
+    changes = calloc(n1 + n2 + 1, sizeof(MFSChange));
+    buf = mfs_malloc(v1, 2*kMFSDiffBufferSize);
+    if (numHash == NULL || match == NULL || changes == NULL || buf == NULL) goto error;
+    uint32_t *matched = match + n1; // v2 records that have a match
+    for(uint32_t i=0; i < n2; i++) {
+        size_t slot = (v2->directory[i]->flFlNum * 2654435761u) & (hashSize-1);
+        while (numHash[slot]) slot = (slot+1) & (hashSize-1);
+        numHash[slot] = i+1;
+    }
+
+    // match by file number
+    for(size_t i=0; i < n1; i++) {
+        uint32_t flNum = v1->directory[i]->flFlNum;
+        for(size_t slot = (flNum * 2654435761u) & (hashSize-1); numHash[slot]; slot = (slot+1) & (hashSize-1)) {
+            uint32_t j = numHash[slot]-1;
+            if (v2->directory[j]->flFlNum != flNum || matched[j]) continue;
+            match[i] = j+1;
+            matched[j] = i+1;
+            break;
+        }
+    }
+
+    // match the rest by name, for files that were replaced by a new one
+    for(size_t i=0; i < n1; i++) {
+        if (match[i]) continue;
+        MFSDirectoryRecord *rec = mfs_directory_lookup(v2, v1->directory[i]->flCName);
+        if (rec == NULL) continue;
+        size_t j;
+        for(j=0; v2->directory[j] != rec; j++);
+        if (matched[j]) continue;
+        match[i] = j+1;
+        matched[j] = i+1;
+    }
+
+    // compare
+    for(size_t i=0; i < n1; i++) {
+        MFSChange *c = &changes[numChanges];
+        c->from = v1->directory[i];
+        if (match[i] == 0) {
+            c->kind = kMFSDiffRemoved;
+            numChanges++;
+            continue;
+        }
+        c->to = v2->directory[match[i]-1];
+        c->what = mfs_diff_record(v1, c->from, v2, c->to, flags, buf);
+        if (c->what == 0) {
+            c->from = c->to = NULL;
+            continue;
+        }
+        if (c->what & kMFSDiffName) c->kind = kMFSDiffRenamed;
+        else if (c->what & (kMFSDiffData | kMFSDiffRsrc)) c->kind = kMFSDiffModified;
+        else c->kind = kMFSDiffMetadata;
+        numChanges++;
+    }
+    for(size_t j=0; j < n2; j++) {
+        if (matched[j]) continue;
+        changes[numChanges].kind = kMFSDiffAdded;
+        changes[numChanges].to = v2->directory[j];
+        numChanges++;
+    }
+
+    mfs_free(v1, numHash);
+    mfs_free(v1, match);
+    mfs_free(v1, buf);
+    *count = numChanges;
+    return changes;
+error:
+    mfs_free(v1, numHash);
+    mfs_free(v1, match);
+    mfs_free(v1, buf);
+    free(changes);
+    return NULL;
+}
+
+void mfs_diff_free (MFSChange *changes) {
+    free(changes);
+}
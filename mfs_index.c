@@ -0,0 +1,400 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Sidecar index: the parsed volume metadata (VABM, directory records in host
+// endianness, folders, name hash and where each Finder comment is in the
+// Desktop file) saved to a file that can be mapped directly on the next mount. It's only valid for the image it was made from,
+// checked by size, modification time and a checksum of the MDB, which changes
+// with every write. The VABM and directory blocks are only read and checked too
+// if the image's modification time isn't known.
+
+// fdopen isn't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSIndexMagic      'MFSi'
+#define kMFSIndexVersion    4
+#define kMFSIndexByteOrder  0x0102
+#define kMFSIndexAlign(x)   (((x)+7) & ~(uint64_t)7)
+
+struct MFSIndexHeader {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    byteOrder;      // kMFSIndexByteOrder in the writer's endianness
+    uint64_t    imgSize;        // size of image file
+    int64_t     imgMTime;       // modification time of image file
+    uint64_t    imgOffset;      // offset to start of volume
+    uint64_t    imgHash;        // checksum of MDB, and VABM and directory blocks if imgMTime is 0
+    uint32_t    flags;          // mfs_vopen flags the index was made with
+    uint32_t    numRecords;
+    uint32_t    numFolders;
+    uint32_t    nameHashSize;
+    uint32_t    numComments;
+    uint64_t    vabmOff;        // section offsets from start of file
+    uint64_t    recOff;
+    uint64_t    recLen;
+    uint64_t    recTableOff;    // uint32_t offset of each record from recOff
+    uint64_t    foldersOff;
+    uint64_t    nameHashOff;
+    uint64_t    commentsOff;    // MFSComment sorted by ID
+    uint64_t    length;         // total file length
+};
+typedef struct MFSIndexHeader MFSIndexHeader;
+
+// private functions
+uint64_t mfs_index_fnv (uint64_t h, const void *buf, size_t len);
+int mfs_index_hash (MFSVolume *vol, uint64_t *hash);
+int mfs_index_header (MFSVolume *vol, MFSIndexHeader *hdr);
+int mfs_index_check (MFSVolume *vol, void *index, MFSIndexHeader *hdr);
+int mfs_index_comment_cmp (const void *a, const void *b);
+int mfs_index_comments (MFSVolume *vol, MFSComment **comments, uint32_t *count);
+
+// FNV-1a
+uint64_t mfs_index_fnv (uint64_t h, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    for(size_t i=0; i < len; i++) h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+// the MDB is already read, the other blocks parsed at mount are only hashed
+// when the modification time can't tell if the image changed
+int mfs_index_hash (MFSVolume *vol, uint64_t *hash) {
+    MFSMasterDirectoryBlock *mdb = &vol->mdb;
+    uint64_t h = mfs_index_fnv(14695981039346656037ull, mdb, sizeof(MFSMasterDirectoryBlock));
+    if (vol->mtime) {
+        *hash = h;
+        return 0;
+    }
+
+    size_t vabm_span = (mdb->drNmAlBlks*3)/2 + sizeof(MFSMasterDirectoryBlock);
+    size_t vabm_blks = vabm_span/kMFSBlockSize + (vabm_span%kMFSBlockSize?1:0);
+    size_t blks = (vabm_blks > mdb->drBlLen)? vabm_blks : mdb->drBlLen;
+    uint8_t *buf = mfs_malloc(vol, blks*kMFSBlockSize);
+    if (buf == NULL) return -1;
+
+    if (-1 == mfs_blkread(vol, vabm_blks, 2, buf)) goto error;
+    h = mfs_index_fnv(h, buf, vabm_blks*kMFSBlockSize);
+    if (-1 == mfs_blkread(vol, mdb->drBlLen, mdb->drDirSt, buf)) goto error;
+    h = mfs_index_fnv(h, buf, mdb->drBlLen*kMFSBlockSize);
+
+    mfs_free(vol, buf);
+    *hash = h;
+    return 0;
+error:
+    mfs_free(vol, buf);
+    return -1;
+}
+
+int mfs_index_header (MFSVolume *vol, MFSIndexHeader *hdr) {
+    bzero(hdr, sizeof(MFSIndexHeader));
+    hdr->magic      = kMFSIndexMagic;
+    hdr->version    = kMFSIndexVersion;
+    hdr->byteOrder  = kMFSIndexByteOrder;
+    hdr->imgSize    = vol->src.size? vol->src.size(vol->src.ctx) : 0;
+    hdr->imgMTime   = vol->mtime;
+    hdr->imgOffset  = vol->offset;
+    return mfs_index_hash(vol, &hdr->imgHash);
+}
+
+// links in the VABM, both names in each record, name hash slots, comments and folders
+int mfs_index_check (MFSVolume *vol, void *index, MFSIndexHeader *hdr) {
+    uint16_t lastBk = vol->mdb.drNmAlBlks + 2;
+    uint16_t *vabm = index + hdr->vabmOff;
+    if (vabm[0] != vol->mdb.drNmAlBlks) return -1;
+    for(size_t n=2; n < lastBk; n++)
+        if (vabm[n] >= lastBk && vabm[n] != kMFSAlBkDir) return -1;
+
+    uint8_t *recs = index + hdr->recOff;
+    uint32_t *recTable = index + hdr->recTableOff;
+    for(uint32_t i=0; i < hdr->numRecords; i++) {
+        // MacRoman name and its terminator, then the UTF-8 name
+        if ((uint64_t)recTable[i] + 52 > hdr->recLen) return -1;
+        MFSDirectoryRecord *rec = (MFSDirectoryRecord*)(recs + recTable[i]);
+        uint64_t uname = (uint64_t)recTable[i] + 52 + rec->flNam[0];
+        if (uname > hdr->recLen || recs[uname-1] != '\0' ||
+            memchr(recs + uname, '\0', hdr->recLen - uname) == NULL) return -1;
+    }
+
+    // slots point at records, and there's always an empty one to end a lookup
+    uint32_t *nameHash = index + hdr->nameHashOff;
+    uint32_t used = 0;
+    for(uint32_t slot=0; slot < hdr->nameHashSize; slot++) {
+        if (nameHash[slot] > hdr->numRecords) return -1;
+        if (nameHash[slot]) used++;
+    }
+    if (hdr->nameHashSize && used >= hdr->nameHashSize) return -1;
+
+    // comments are looked up by binary search, where they point is read
+    // from the Desktop fork, which can't be read past its end
+    MFSComment *comments = index + hdr->commentsOff;
+    for(uint32_t c=0; c < hdr->numComments; c++) {
+        if (comments[c].length > 255) return -1;
+        if (c && comments[c].id <= comments[c-1].id) return -1;
+    }
+
+    // names are C strings, and subfolder counts agree with the parents,
+    // counted like mfs_load_folders does
+    MFSFolder *folders = index + hdr->foldersOff;
+    if (hdr->numFolders == 0) return 0;
+    int16_t *subdirs = mfs_calloc(vol, hdr->numFolders, sizeof(int16_t));
+    if (subdirs == NULL) return -1;
+    for(uint32_t f=0; f < hdr->numFolders; f++) {
+        if (memchr(folders[f].fdCNam, '\0', sizeof folders[f].fdCNam) == NULL ||
+            memchr(folders[f].fdUName, '\0', sizeof folders[f].fdUName) == NULL) goto invalid;
+        if (folders[f].fdParent == kMFSFolderDesktop) continue;
+        for(uint32_t p=0; p < hdr->numFolders; p++) if (folders[p].fdID == folders[f].fdParent) {
+            subdirs[p]++;
+            break;
+        }
+    }
+    for(uint32_t f=0; f < hdr->numFolders; f++) if (folders[f].fdSubdirs != subdirs[f]) goto invalid;
+    mfs_free(vol, subdirs);
+    return 0;
+invalid:
+    mfs_free(vol, subdirs);
+    return -1;
+}
+
+// returns 0 and fills in vol if the index at path is valid for vol, -1 otherwise
+int mfs_index_load (MFSVolume *vol, const char *path, int flags) {
+    MFSIndexHeader cur;
+    if (-1 == mfs_index_header(vol, &cur)) return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (-1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(MFSIndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    // private mapping, so records can be written to like malloc'd ones
+    void *index = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED) return -1;
+
+    // check it matches the image
+    MFSIndexHeader *hdr = index;
+    if (hdr->magic != kMFSIndexMagic ||
+        hdr->version != kMFSIndexVersion ||
+        hdr->byteOrder != kMFSIndexByteOrder ||
+        hdr->length != (uint64_t)st.st_size ||
+        hdr->imgSize != cur.imgSize ||
+        hdr->imgMTime != cur.imgMTime ||
+        hdr->imgOffset != cur.imgOffset ||
+        hdr->imgHash != cur.imgHash ||
+        (flags & MFS_FOLDERS & ~hdr->flags) ||
+        hdr->numRecords > vol->mdb.drNmFls) goto invalid;
+
+    // check sections are inside the file
+    if (hdr->vabmOff + sizeof(uint16_t)*(vol->mdb.drNmAlBlks+2) > hdr->length ||
+        hdr->recOff + hdr->recLen > hdr->length ||
+        hdr->recTableOff + sizeof(uint32_t)*hdr->numRecords > hdr->length ||
+        hdr->foldersOff + sizeof(MFSFolder)*hdr->numFolders > hdr->length ||
+        hdr->nameHashOff + sizeof(uint32_t)*hdr->nameHashSize > hdr->length ||
+        hdr->commentsOff + sizeof(MFSComment)*hdr->numComments > hdr->length ||
+        (hdr->nameHashSize & (hdr->nameHashSize-1)) ||
+        (hdr->numFolders && !(hdr->flags & MFS_FOLDERS))) goto invalid;
+    if (kMFSIndexAlign(hdr->vabmOff) != hdr->vabmOff ||
+        kMFSIndexAlign(hdr->recTableOff) != hdr->recTableOff ||
+        kMFSIndexAlign(hdr->foldersOff) != hdr->foldersOff ||
+        kMFSIndexAlign(hdr->nameHashOff) != hdr->nameHashOff ||
+        kMFSIndexAlign(hdr->commentsOff) != hdr->commentsOff) goto invalid;
+
+    // the sections are only used after this, so check what they point to
+    // a stale index that happens to match the header mustn't read outside them
+    if (-1 == mfs_index_check(vol, index, hdr)) goto invalid;
+
+    // pointers to records
+    uint32_t *recTable = index + hdr->recTableOff;
+    MFSDirectoryRecord **dir = mfs_arena_alloc(vol, (hdr->numRecords+1)*sizeof(MFSDirectoryRecord*));
+    if (dir == NULL) goto invalid;
+    for(uint32_t i=0; i < hdr->numRecords; i++) dir[i] = index + hdr->recOff + recTable[i];
+    dir[hdr->numRecords] = NULL;
+
+    vol->index          = index;
+    vol->indexLen       = hdr->length;
+    vol->vabm           = index + hdr->vabmOff;
+    vol->directory      = dir;
+    vol->numFolders     = hdr->numFolders;
+    vol->folders        = hdr->numFolders? index + hdr->foldersOff : NULL;
+    vol->nameHash       = hdr->nameHashSize? index + hdr->nameHashOff : NULL;
+    vol->nameHashSize   = hdr->nameHashSize;
+    vol->comments       = hdr->numComments? index + hdr->commentsOff : NULL;
+    vol->numComments    = hdr->numComments;
+    return 0;
+invalid:
+    munmap(index, st.st_size);
+    return -1;
+}
+
+int mfs_index_comment_cmp (const void *a, const void *b) {
+    const MFSComment *ca = a, *cb = b;
+    if (ca->id != cb->id) return (ca->id < cb->id)? -1 : 1;
+    return (ca->offset < cb->offset)? -1 : (ca->offset > cb->offset);
+}
+
+// FCMT resources in the Desktop file, sorted by ID, with the length of each
+// comment so it can be read without the resource map
+int mfs_index_comments (MFSVolume *vol, MFSComment **comments, uint32_t *count) {
+    *comments = NULL;
+    *count = 0;
+    MFSDirectoryRecord *dr = mfs_directory_lookup(vol, "Desktop");
+    if (dr == NULL || dr->flRStBlk == 0) return 0;
+    // an index without the comments would hide them
+    MFSResourceFile *desktop = mfs_desktop(vol);
+    if (desktop == NULL) return -1;
+    size_t numRes;
+    MFSResource *fcmt = mfs_res_list(desktop, 'FCMT', &numRes);
+    if (numRes == 0) return 0;
+    MFSComment *cmts = mfs_calloc(vol, numRes, sizeof(MFSComment));
+    if (cmts == NULL) return -1;
+
+    // comments that can't be read aren't there, like in mfs_comment
+    uint32_t n = 0;
+    for(size_t i=0; i < numRes; i++) {
+        unsigned char cmtLen;
+        uint32_t resLen = mfs_res_length(desktop, &fcmt[i]);
+        if (resLen == 0 || mfs_res_read(desktop, &fcmt[i], 1, 0, &cmtLen) != 1) continue;
+        cmts[n].id = fcmt[i].id;
+        cmts[n].length = (cmtLen < resLen)? cmtLen : resLen - 1;
+        cmts[n].offset = fcmt[i].offset;
+        n++;
+    }
+
+    // resources with the same ID are invalid, keep one
+    qsort(cmts, n, sizeof(MFSComment), mfs_index_comment_cmp);
+    uint32_t unique = 0;
+    for(uint32_t i=0; i < n; i++)
+        if (unique == 0 || cmts[i].id != cmts[unique-1].id) cmts[unique++] = cmts[i];
+    *comments = cmts;
+    *count = unique;
+    return 0;
+}
+
+// Finder comment from the index, read straight from the Desktop resource fork
+char * mfs_index_comment (MFSVolume *vol, int16_t id) {
+    size_t lo = 0, hi = vol->numComments;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (vol->comments[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == vol->numComments || vol->comments[lo].id != id) return NULL;
+    MFSComment *cmt = &vol->comments[lo];
+    MFSFork *fk = mfs_desktop_fork(vol);
+    if (fk == NULL) return NULL;
+    char *comment = malloc(cmt->length + 1);
+    if (comment == NULL) return NULL;
+    int readBytes = mfs_fkread_at(fk, cmt->length, cmt->offset + 1, comment);
+    comment[(readBytes > 0)? readBytes : 0] = '\0';
+    return comment;
+}
+
+int mfs_index_write (MFSVolume *vol, const char *path) {
+    MFSIndexHeader hdr;
+    if (vol == NULL || path == NULL) {errno = EINVAL; return -1;}
+    if (-1 == mfs_index_header(vol, &hdr)) return -1;
+    MFSComment *comments;
+    uint32_t numComments;
+    if (-1 == mfs_index_comments(vol, &comments, &numComments)) return -1;
+
+    // lay out sections
+    uint32_t numRecords = 0;
+    uint64_t recLen = 0;
+    while (vol->directory[numRecords]) recLen += mfs_directory_record_size(vol->directory[numRecords++]);
+    hdr.flags           = vol->flags & MFS_FOLDERS;
+    hdr.numRecords      = numRecords;
+    hdr.numFolders      = vol->folders? vol->numFolders : 0;
+    hdr.nameHashSize    = vol->nameHash? vol->nameHashSize : 0;
+    hdr.vabmOff         = kMFSIndexAlign(sizeof(MFSIndexHeader));
+    hdr.recOff          = kMFSIndexAlign(hdr.vabmOff + sizeof(uint16_t)*(vol->mdb.drNmAlBlks+2));
+    hdr.recLen          = recLen;
+    hdr.recTableOff     = kMFSIndexAlign(hdr.recOff + recLen);
+    hdr.foldersOff      = kMFSIndexAlign(hdr.recTableOff + sizeof(uint32_t)*numRecords);
+    hdr.nameHashOff     = kMFSIndexAlign(hdr.foldersOff + sizeof(MFSFolder)*hdr.numFolders);
+    hdr.numComments     = numComments;
+    hdr.commentsOff     = kMFSIndexAlign(hdr.nameHashOff + sizeof(uint32_t)*hdr.nameHashSize);
+    hdr.length          = hdr.commentsOff + sizeof(MFSComment)*numComments;
+
+    uint8_t *index = mfs_calloc(vol, 1, hdr.length);
+    if (index == NULL) {
+        mfs_free(vol, comments);
+        return -1;
+    }
+    memcpy(index, &hdr, sizeof hdr);
+    memcpy(index + hdr.vabmOff, vol->vabm, sizeof(uint16_t)*(vol->mdb.drNmAlBlks+2));
+    uint32_t *recTable = (uint32_t*)(index + hdr.recTableOff);
+    uint64_t recOff = 0;
+    for(uint32_t i=0; i < numRecords; i++) {
+        size_t recSize = mfs_directory_record_size(vol->directory[i]);
+        memcpy(index + hdr.recOff + recOff, vol->directory[i], recSize);
+        recTable[i] = recOff;
+        recOff += recSize;
+    }
+    if (hdr.numFolders) memcpy(index + hdr.foldersOff, vol->folders, sizeof(MFSFolder)*hdr.numFolders);
+    if (hdr.nameHashSize) memcpy(index + hdr.nameHashOff, vol->nameHash, sizeof(uint32_t)*hdr.nameHashSize);
+    if (numComments) memcpy(index + hdr.commentsOff, comments, sizeof(MFSComment)*numComments);
+    mfs_free(vol, comments);
+
+    // write to a temporary file and rename it, so readers never see a partial index
+    // the name is unique, other threads may be writing an index for the same image
+    // open applies the umask to its mode, mkstemp would always make it 0600
+    static unsigned int tmpCount;
+    char *tmpPath = malloc(strlen(path) + 32);
+    if (tmpPath == NULL) goto error;
+    int fd;
+    do {
+        sprintf(tmpPath, "%s.%ld.%u", path, (long)getpid(), __sync_fetch_and_add(&tmpCount, 1));
+        fd = open(tmpPath, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    } while (fd == -1 && errno == EEXIST);
+    if (fd == -1) goto error;
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmpPath);
+        goto error;
+    }
+    if (fwrite(index, hdr.length, 1, fp) != 1) {
+        fclose(fp);
+        unlink(tmpPath);
+        goto error;
+    }
+    if (fclose(fp) || rename(tmpPath, path)) {
+        unlink(tmpPath);
+        goto error;
+    }
+    free(tmpPath);
+    mfs_free(vol, index);
+    return 0;
+error:
+    free(tmpPath);
+    mfs_free(vol, index);
+    return -1;
+}
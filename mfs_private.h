@@ -0,0 +1,90 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// functions shared between libmfs source files, not part of the API
+
+#ifndef _MFS_PRIVATE_H_
+#define _MFS_PRIVATE_H_
+
+#include "mfs.h"
+
+#define mfs_round(x, n) ((((x)+(n)-1)/(n))*(n))
+
+// where a Finder comment is in the Desktop resource fork, see mfs_index_comment
+struct MFSComment {
+    int16_t     id;         // FCMT resource ID
+    uint16_t    length;     // length of the comment, not counting its length byte
+    uint32_t    offset;     // of the Str255 in the fork
+};
+typedef struct MFSComment MFSComment;
+
+// MacRoman uppercase table, see mfs_fneq
+extern const uint8_t mfs_chars_toupper[256];
+// Unicode equivalents of MacRoman 0x80-0xFF, see mfs_utf8_from_macroman
+extern const uint16_t mfs_chars_unicode[128];
+
+MFSVolume* mfs_vopen_internal (const MFSBlockSource *src, size_t offset, int flags, const char *indexPath, time_t mtime, const MFSAllocator *alloc);
+int mfs_read_at (MFSVolume *vol, void *buf, size_t size, off_t offset);
+void mfs_prefetch (MFSVolume *vol, size_t size, off_t offset);
+void mfs_advise (MFSVolume *vol, size_t size, off_t offset, int advice);
+int mfs_fkadvise_real (MFSFork *fk, size_t size, size_t offset, int advice);
+int mfs_blkread (MFSVolume *vol, size_t numBlocks, size_t offset, void *buf);
+int mfs_albkread (MFSVolume *vol, size_t numBlocks, uint16_t start, void *buf);
+int mfs_fkread_at_appledouble (MFSFork *fk, size_t size, size_t offset, void *buf);
+int mfs_fkread_at_real (MFSFork *fk, size_t size, size_t offset, void *buf);
+int mfs_fkread_at_encoded (MFSFork *fk, size_t size, size_t offset, void *buf);
+ssize_t mfs_fksegments_encoded (MFSFork *fk, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs);
+MFSFork* mfs_fkopen_encoded (MFSVolume *vol, MFSDirectoryRecord *rec, int mode);
+AppleDouble * mfs_applesingle_header (MFSFork *fk);
+struct MacBinaryHeader * mfs_macbinary_header (MFSFork *fk);
+uint16_t mfs_crc16 (uint16_t crc, const void *buf, size_t len);
+size_t mfs_fkrun (MFSFork *fk, size_t bkn, size_t bkOff, size_t size, off_t *runOff, size_t *runLen);
+MFSVABM mfs_vabm (MFSVolume *vol);
+MFSDirectoryRecord ** mfs_directory_read (MFSVolume *vol, int arena);
+MFSDirectoryRecord* mfs_directory_record (MFSDirectoryRecord *dst, MFSDirectoryRecord *src, size_t size);
+int16_t mfs_comment_id (const char *flCName);
+char * mfs_comment_read (MFSVolume *vol, int16_t cmtID);
+int mfs_appledouble_comment (MFSVolume *vol, AppleDouble *as, int e, const char *name);
+MFSFork * mfs_desktop_fork (MFSVolume *vol);
+int16_t mfs_folder_id (MFSDirectoryRecord *rec);
+int mfs_load_folders (MFSVolume *vol);
+int mfs_fneq (const uint8_t *s1, const uint8_t *s2);
+int mfs_fneq_utf8 (const uint8_t *name, const uint8_t *uname);
+size_t mfs_directory_record_size (MFSDirectoryRecord *rec);
+uint32_t mfs_name_hash (const uint8_t *name);
+int mfs_name_hash_build (MFSVolume *vol);
+int mfs_columns_build (MFSVolume *vol);
+#if defined(LIBMFS_VERBOSE)
+int mfs_printmdb (MFSMasterDirectoryBlock *mdb);
+int mfs_printrecord (MFSDirectoryRecord *rec);
+#endif
+
+// volume memory (mfs_alloc.c)
+extern const MFSAllocator mfs_allocator_default;
+void * mfs_arena_alloc (MFSVolume *vol, size_t size);
+void mfs_arena_release (MFSVolume *vol);
+void * mfs_malloc (MFSVolume *vol, size_t size);
+void * mfs_calloc (MFSVolume *vol, size_t count, size_t size);
+void mfs_free (MFSVolume *vol, void *ptr);
+
+// sidecar index (mfs_index.c)
+int mfs_index_load (MFSVolume *vol, const char *path, int flags);
+char * mfs_index_comment (MFSVolume *vol, int16_t id);
+
+#endif /* _MFS_PRIVATE_H_ */
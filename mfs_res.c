@@ -0,0 +1,200 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Resource fork reader: the resource map is read once and indexed by type and
+// ID, resource data is read from the fork when it's needed.
+// http://developer.apple.com/documentation/mac/MoreToolbox/MoreToolbox-99.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSResLengthUnknown    0xFFFFFFFF
+
+struct __attribute__ ((__packed__)) MFSResHeader {
+    uint32_t    dataOff;
+    uint32_t    mapOff;
+    uint32_t    dataLen;
+    uint32_t    mapLen;
+};
+
+// private functions
+uint32_t mfs_res_hash (uint32_t type, int16_t id);
+
+uint32_t mfs_res_hash (uint32_t type, int16_t id) {
+    uint32_t hash = (type ^ (uint16_t)id) * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+// the fork belongs to the resource file after this, even if it fails
+MFSResourceFile* mfs_res_open (MFSFork *fk) {
+    struct MFSResHeader hdr;
+    uint8_t *map = NULL;
+    MFSResourceFile *rf = NULL;
+    if (fk == NULL) return NULL;
+
+    // read header and map
+    if (mfs_fkread_at(fk, sizeof hdr, 0, &hdr) != sizeof hdr) goto error;
+    hdr.dataOff = ntohl(hdr.dataOff);
+    hdr.mapOff  = ntohl(hdr.mapOff);
+    hdr.dataLen = ntohl(hdr.dataLen);
+    hdr.mapLen  = ntohl(hdr.mapLen);
+    if (hdr.mapLen < 30 || hdr.mapOff + hdr.mapLen > mfs_fksize(fk)) goto invalid;
+    map = mfs_malloc(fk->fkVol, hdr.mapLen);
+    if (map == NULL) goto error;
+    if (mfs_fkread_at(fk, hdr.mapLen, hdr.mapOff, map) != (int)hdr.mapLen) goto error;
+
+    // count resources and space for names
+    size_t typeListOff = ntohs(*(uint16_t*)(map+24));
+    size_t nameListOff = ntohs(*(uint16_t*)(map+26));
+    if (typeListOff + 2 > hdr.mapLen) goto invalid;
+    uint8_t *typeList = map + typeListOff;
+    size_t numTypes = (uint16_t)(ntohs(*(uint16_t*)typeList) + 1);
+    size_t count = 0, namesLen = 0;
+    if (typeListOff + 2 + 8*numTypes > hdr.mapLen) goto invalid;
+    for(size_t t=0; t < numTypes; t++) {
+        uint8_t *te = typeList + 2 + 8*t;
+        size_t numRefs = ntohs(*(uint16_t*)(te+4)) + 1;
+        uint8_t *ref = typeList + ntohs(*(uint16_t*)(te+6));
+        if (ref + 12*numRefs > map + hdr.mapLen) goto invalid;
+        for(size_t r=0; r < numRefs; r++, ref += 12) {
+            uint16_t nameOff = ntohs(*(uint16_t*)(ref+2));
+            if (nameOff != 0xFFFF && nameListOff + nameOff < hdr.mapLen) namesLen += map[nameListOff + nameOff] + 1;
+        }
+        count += numRefs;
+    }
+
+    // resources, types and hash in one allocation, names after them
+    size_t hashSize = 8;
+    while (hashSize < 2*count) hashSize *= 2;
+    size_t rfSize = sizeof(MFSResourceFile) + sizeof(MFSResource)*count + sizeof(MFSResourceType)*numTypes + sizeof(uint32_t)*hashSize;
+    rf = mfs_calloc(fk->fkVol, 1, rfSize + namesLen);
+    if (rf == NULL) goto error;
+    rf->fork = fk;
+    rf->count = count;
+    rf->res = (void*)rf + sizeof(MFSResourceFile);
+    rf->numTypes = numTypes;
+    rf->types = (void*)rf->res + sizeof(MFSResource)*count;
+    rf->hash = (void*)rf->types + sizeof(MFSResourceType)*numTypes;
+    rf->hashSize = hashSize;
+    char *names = (void*)rf + rfSize;
+
+    // parse refs, grouped by type
+    MFSResource *res = rf->res;
+    for(size_t t=0; t < numTypes; t++) {
+        uint8_t *te = typeList + 2 + 8*t;
+        uint32_t type = ntohl(*(uint32_t*)te);
+        size_t numRefs = ntohs(*(uint16_t*)(te+4)) + 1;
+        uint8_t *ref = typeList + ntohs(*(uint16_t*)(te+6));
+        rf->types[t].type = type;
+        rf->types[t].first = res;
+        rf->types[t].count = numRefs;
+        for(size_t r=0; r < numRefs; r++, ref += 12, res++) {
+            res->type = type;
+            res->id = ntohs(*(uint16_t*)ref);
+            res->attrs = ref[4];
+            res->offset = hdr.dataOff + ((ref[5] << 16) | (ref[6] << 8) | ref[7]) + 4;
+            res->length = kMFSResLengthUnknown;
+            // name
+            uint16_t nameOff = ntohs(*(uint16_t*)(ref+2));
+            if (nameOff != 0xFFFF && nameListOff + nameOff < hdr.mapLen) {
+                uint8_t *pname = map + nameListOff + nameOff;
+                size_t nameLen = pname[0];
+                if (nameListOff + nameOff + 1 + nameLen > hdr.mapLen) nameLen = hdr.mapLen - nameListOff - nameOff - 1;
+                memcpy(names, pname+1, nameLen);
+                names[nameLen] = '\0';
+                res->name = names;
+                names += nameLen + 1;
+            }
+            // index
+            size_t slot = mfs_res_hash(type, res->id) & (hashSize-1);
+            while (rf->hash[slot]) slot = (slot+1) & (hashSize-1);
+            rf->hash[slot] = (res - rf->res) + 1;
+        }
+    }
+
+    mfs_free(fk->fkVol, map);
+    return rf;
+invalid:
+    errno = EINVAL;
+error:
+    mfs_free(fk->fkVol, map);
+    mfs_free(fk->fkVol, rf);
+    mfs_fkclose(fk);
+    return NULL;
+}
+
+int mfs_res_close (MFSResourceFile *rf) {
+    if (rf == NULL) {errno = EBADF; return -1;}
+    MFSVolume *vol = rf->fork->fkVol;
+    mfs_fkclose(rf->fork);
+    mfs_free(vol, rf);
+    return 0;
+}
+
+MFSResource* mfs_res_find (MFSResourceFile *rf, uint32_t type, int16_t id) {
+    if (rf == NULL) return NULL;
+    size_t mask = rf->hashSize-1;
+    for(size_t slot = mfs_res_hash(type, id) & mask; rf->hash[slot]; slot = (slot+1) & mask) {
+        MFSResource *res = &rf->res[rf->hash[slot]-1];
+        if (res->type == type && res->id == id) return res;
+    }
+    return NULL;
+}
+
+// all resources of a type, consecutive in the array
+MFSResource* mfs_res_list (MFSResourceFile *rf, uint32_t type, size_t *count) {
+    *count = 0;
+    if (rf == NULL) return NULL;
+    for(size_t t=0; t < rf->numTypes; t++) {
+        if (rf->types[t].type != type) continue;
+        *count = rf->types[t].count;
+        return rf->types[t].first;
+    }
+    return NULL;
+}
+
+// length of resource data, read from the data area the first time
+uint32_t mfs_res_length (MFSResourceFile *rf, MFSResource *res) {
+    uint32_t length = res->length;
+    if (length != kMFSResLengthUnknown) return length;
+    if (mfs_fkread_at(rf->fork, 4, res->offset - 4, &length) != 4) return 0;
+    length = ntohl(length);
+    // other threads can only store the same value
+    __sync_bool_compare_and_swap(&res->length, kMFSResLengthUnknown, length);
+    return length;
+}
+
+int mfs_res_read (MFSResourceFile *rf, MFSResource *res, size_t size, size_t offset, void *buf) {
+    size_t length = mfs_res_length(rf, res);
+    if (offset >= length) return 0;
+    if (offset + size > length) size = length - offset;
+    return mfs_fkread_at(rf->fork, size, res->offset + offset, buf);
+}
+
+ssize_t mfs_res_segments (MFSResourceFile *rf, MFSResource *res, size_t size, size_t offset, MFSForkSegment *seg, size_t maxSegs) {
+    size_t length = mfs_res_length(rf, res);
+    if (offset >= length) return 0;
+    if (offset + size > length) size = length - offset;
+    return mfs_fksegments(rf->fork, size, res->offset + offset, seg, maxSegs);
+}
@@ -0,0 +1,196 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Filename search: every name on the volume is case-folded once into a single
+// buffer, separated by NULs, and patterns are matched against the whole buffer
+// at a time instead of record by record.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "mfs.h"
+#include "mfs_private.h"
+
+// private functions
+int mfs_search_fold (MFSVolume *vol);
+size_t mfs_search_scan (const uint8_t *hay, size_t len, const uint8_t *pat, size_t patLen, size_t from);
+int mfs_search_glob (const uint8_t *name, const uint8_t *pat);
+int mfs_search_filter (MFSDirectoryRecord *rec, const MFSSearch *search);
+
+// build folded names, once per volume
+int mfs_search_fold (MFSVolume *vol) {
+    // foldedOff is published last, so the lock is only taken to build
+    if (__atomic_load_n(&vol->foldedOff, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&vol->lock);
+    if (vol->foldedOff) {
+        pthread_mutex_unlock(&vol->lock);
+        return 0;
+    }
+
+    size_t count, len = 0;
+    for(count = 0; vol->directory[count]; count++) len += vol->directory[count]->flNam[0] + 1;
+    // offsets, then names and padding for unaligned loads
+    uint32_t *off = mfs_arena_alloc(vol, sizeof(uint32_t)*(count+1) + len + 16);
+    if (off == NULL) {
+        pthread_mutex_unlock(&vol->lock);
+        return -1;
+    }
+    uint8_t *names = (uint8_t*)(off + count + 1);
+
+    len = 0;
+    for(size_t i=0; i < count; i++) {
+        const uint8_t *name = (const uint8_t*)vol->directory[i]->flCName;
+        off[i] = len;
+        while (*name) names[len++] = mfs_chars_toupper[*name++];
+        names[len++] = '\0';
+    }
+    off[count] = len;
+    memset(names + len, 0, 16);
+
+    vol->foldedNames = (char*)names;
+    __atomic_store_n(&vol->foldedOff, off, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+// position of the first occurrence of pat in hay at or after from, or len if there is none
+size_t mfs_search_scan (const uint8_t *hay, size_t len, const uint8_t *pat, size_t patLen, size_t from) {
+    size_t i = from;
+    if (patLen == 0) return from;
+    if (patLen > len) return len;
+#if defined(__SSE2__)
+    // compare first and last bytes of the pattern at 16 positions at a time
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[patLen-1]);
+    for(; i + patLen - 1 + 16 <= len; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(hay + i + patLen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(hay + pos, pat, patLen) == 0) return pos;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i + patLen <= len; i++) {
+        const uint8_t *p = memchr(hay + i, pat[0], len - patLen + 1 - i);
+        if (p == NULL) break;
+        i = p - hay;
+        if (memcmp(p, pat, patLen) == 0) return i;
+    }
+    return len;
+}
+
+// * matches any characters, ? matches one
+int mfs_search_glob (const uint8_t *name, const uint8_t *pat) {
+    const uint8_t *star = NULL, *resume = NULL;
+    while (*name) {
+        if (*pat == '*') {
+            star = pat++;
+            resume = name;
+        } else if (*pat == '?' || *pat == *name) {
+            pat++;
+            name++;
+        } else if (star) {
+            pat = star + 1;
+            name = ++resume;
+        } else return 0;
+    }
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
+
+int mfs_search_filter (MFSDirectoryRecord *rec, const MFSSearch *search) {
+    if (search->type && rec->flUsrWds.type != htonl(search->type)) return 0;
+    if (search->creator && rec->flUsrWds.creator != htonl(search->creator)) return 0;
+    return 1;
+}
+
+// calls callback for every matching file on the volumes, until it returns nonzero
+// returns the number of matches, or -1 on error
+ssize_t mfs_search (MFSVolume **vols, size_t numVols, const MFSSearch *search, MFSSearchCallback callback, void *ctx) {
+    if (vols == NULL || search == NULL || callback == NULL) {errno = EINVAL; return -1;}
+
+    // fold pattern, and find the longest literal part of a glob
+    size_t patLen = search->pattern? strlen(search->pattern) : 0;
+    uint8_t *pat = malloc(patLen+1);
+    if (pat == NULL) return -1;
+    for(size_t i=0; i < patLen; i++) pat[i] = mfs_chars_toupper[(uint8_t)search->pattern[i]];
+    pat[patLen] = '\0';
+    const uint8_t *lit = pat;
+    size_t litLen = patLen;
+    if (search->kind == kMFSSearchGlob) {
+        litLen = 0;
+        for(size_t i=0, j; i < patLen; i = j+1) {
+            for(j = i; j < patLen && pat[j] != '*' && pat[j] != '?'; j++);
+            if (j - i > litLen) {
+                lit = pat + i;
+                litLen = j - i;
+            }
+        }
+    }
+
+    ssize_t matches = 0;
+    for(size_t v=0; v < numVols; v++) {
+        MFSVolume *vol = vols[v];
+        if (-1 == mfs_search_fold(vol)) goto error;
+        const uint8_t *names = (const uint8_t*)vol->foldedNames;
+        const uint32_t *off = vol->foldedOff;
+        size_t count;
+        for(count = 0; vol->directory[count]; count++);
+        size_t len = off[count];
+        MFSDirectoryRecord *rec;
+
+        if (search->kind == kMFSSearchPrefix || litLen == 0) {
+            // test every name
+            for(size_t r=0; r < count; r++) {
+                rec = vol->directory[r];
+                if (search->kind == kMFSSearchPrefix && (off[r+1]-off[r]-1 < patLen || memcmp(names + off[r], pat, patLen))) continue;
+                if (search->kind == kMFSSearchGlob && !mfs_search_glob(names + off[r], pat)) continue;
+                if (!mfs_search_filter(rec, search)) continue;
+                matches++;
+                if (callback(ctx, vol, rec)) goto done;
+            }
+            continue;
+        }
+
+        // scan all names for the literal, then check the names it's in
+        size_t r = 0;
+        for(size_t pos = 0; (pos = mfs_search_scan(names, len, lit, litLen, pos)) < len; pos = off[r]) {
+            while (off[r+1] <= pos) r++;
+            rec = vol->directory[r++];
+            if (search->kind == kMFSSearchGlob && !mfs_search_glob(names + off[r-1], pat)) continue;
+            if (!mfs_search_filter(rec, search)) continue;
+            matches++;
+            if (callback(ctx, vol, rec)) goto done;
+        }
+    }
+done:
+    free(pat);
+    return matches;
+error:
+    free(pat);
+    return -1;
+}
@@ -0,0 +1,315 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Tar export: the folder tree as a pax (POSIX.1-2001) tar stream. Resource
+// forks and Finder info go in SCHILY.xattr records, like bsdtar and GNU tar
+// use for extended attributes, or in ._ AppleDouble members. Everything goes
+// through one fixed-size buffer: headers are collected in it, and forks are
+// read into it a run of contiguous blocks at a time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+#define kMFSTarBufferSize   (1024*1024)
+#define kMFSTarBlockSize    512
+#define kMFSTarMaxSegments  16
+// longest file name in UTF-8, each MacRoman character can take 3 bytes
+#define kMFSTarNameMax      (3*255+1)
+
+struct __attribute__ ((__packed__)) MFSTarHeader {
+    char    name[100];
+    char    mode[8];
+    char    uid[8];
+    char    gid[8];
+    char    size[12];
+    char    mtime[12];
+    char    chksum[8];
+    char    typeflag;
+    char    linkname[100];
+    char    magic[6];
+    char    version[2];
+    char    uname[32];
+    char    gname[32];
+    char    devmajor[8];
+    char    devminor[8];
+    char    prefix[155];
+    char    pad[12];
+};
+typedef struct MFSTarHeader MFSTarHeader;
+
+struct MFSTarWriter {
+    MFSVolume   *vol;
+    int         fd;
+    int         flags;
+    uint8_t     *buf;
+    size_t      len;
+    uint8_t     *done;      // files that have been written
+    uint8_t     *visited;   // folders that have been written
+};
+typedef struct MFSTarWriter MFSTarWriter;
+
+// private functions
+int mfs_tar_flush (MFSTarWriter *w);
+int mfs_tar_write (MFSTarWriter *w, const void *data, size_t size);
+int mfs_tar_pad (MFSTarWriter *w, uint64_t size);
+int mfs_tar_fork (MFSTarWriter *w, MFSFork *fk, size_t size);
+size_t mfs_tar_record_len (size_t keyLen, size_t valueLen);
+int mfs_tar_record (MFSTarWriter *w, const char *key, const void *value, size_t valueLen);
+int mfs_tar_header (MFSTarWriter *w, const char *path, char type, uint64_t size, int mode, uint32_t mfsDate);
+int mfs_tar_file (MFSTarWriter *w, MFSDirectoryRecord *rec, char *path, size_t dirLen);
+int mfs_tar_folder (MFSTarWriter *w, int16_t folder, char *path, size_t dirLen);
+
+int mfs_tar_flush (MFSTarWriter *w) {
+    uint8_t *p = w->buf;
+    while (w->len) {
+        ssize_t wb = write(w->fd, p, w->len);
+        if (wb == -1 && errno == EINTR) continue;
+        if (wb <= 0) return -1;
+        p += wb;
+        w->len -= wb;
+    }
+    return 0;
+}
+
+int mfs_tar_write (MFSTarWriter *w, const void *data, size_t size) {
+    while (size) {
+        if (w->len == kMFSTarBufferSize && -1 == mfs_tar_flush(w)) return -1;
+        size_t len = kMFSTarBufferSize - w->len;
+        if (len > size) len = size;
+        memcpy(w->buf + w->len, data, len);
+        w->len += len;
+        data += len;
+        size -= len;
+    }
+    return 0;
+}
+
+// zeros up to the next tar block after size bytes
+int mfs_tar_pad (MFSTarWriter *w, uint64_t size) {
+    static const uint8_t zeros[kMFSTarBlockSize];
+    if (size % kMFSTarBlockSize == 0) return 0;
+    return mfs_tar_write(w, zeros, kMFSTarBlockSize - size % kMFSTarBlockSize);
+}
+
+// size bytes of a fork, read straight into the buffer a run at a time
+int mfs_tar_fork (MFSTarWriter *w, MFSFork *fk, size_t size) {
+    MFSVolume *vol = w->vol;
+    MFSForkSegment seg[kMFSTarMaxSegments];
+    size_t offset = 0;
+    mfs_fkadvise(fk, 0, 0, kMFSAdviseSequential);
+    while (offset < size) {
+        ssize_t numSegs = mfs_fksegments(fk, size - offset, offset, seg, kMFSTarMaxSegments);
+        if (numSegs <= 0) {errno = EIO; return -1;}
+        for(ssize_t i=0; i < numSegs; i++) {
+            if (seg[i].data || vol->src.base) {
+                // in memory already
+                const void *data = seg[i].data? seg[i].data : vol->src.base + seg[i].offset;
+                if (-1 == mfs_tar_write(w, data, seg[i].length)) return -1;
+            } else for(size_t done = 0; done < seg[i].length;) {
+                if (w->len == kMFSTarBufferSize && -1 == mfs_tar_flush(w)) return -1;
+                size_t len = kMFSTarBufferSize - w->len;
+                if (len > seg[i].length - done) len = seg[i].length - done;
+                if (-1 == mfs_read_at(vol, w->buf + w->len, len, seg[i].offset + done - vol->offset)) return -1;
+                w->len += len;
+                done += len;
+            }
+            // what's been copied out won't be read again, drop it from the cache
+            if (seg[i].data == NULL) mfs_advise(vol, seg[i].length, seg[i].offset - vol->offset, kMFSAdviseDontNeed);
+            offset += seg[i].length;
+        }
+    }
+    return 0;
+}
+
+// length of "%d key=value\n", counting its own digits
+size_t mfs_tar_record_len (size_t keyLen, size_t valueLen) {
+    size_t len = keyLen + valueLen + 3, digits = 1;
+    for(size_t p = 10; len + digits >= p; p *= 10) digits++;
+    return len + digits;
+}
+
+// a pax record, value can be NULL if the caller writes it
+int mfs_tar_record (MFSTarWriter *w, const char *key, const void *value, size_t valueLen) {
+    char prefix[64];
+    int len = snprintf(prefix, sizeof prefix, "%zu %s=", mfs_tar_record_len(strlen(key), valueLen), key);
+    if (-1 == mfs_tar_write(w, prefix, len)) return -1;
+    if (value && -1 == mfs_tar_write(w, value, valueLen)) return -1;
+    if (value && -1 == mfs_tar_write(w, "\n", 1)) return -1;
+    return 0;
+}
+
+// ustar header, path must fit (see mfs_tar_file)
+int mfs_tar_header (MFSTarWriter *w, const char *path, char type, uint64_t size, int mode, uint32_t mfsDate) {
+    MFSTarHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    // not NUL-terminated if it takes the whole field
+    size_t pathLen = strlen(path);
+    memcpy(hdr.name, path, (pathLen < sizeof hdr.name)? pathLen : sizeof hdr.name);
+    sprintf(hdr.mode, "%07o", mode);
+    sprintf(hdr.uid, "%07o", 0);
+    sprintf(hdr.gid, "%07o", 0);
+    sprintf(hdr.size, "%011llo", (unsigned long long)size);
+    sprintf(hdr.mtime, "%011llo", (unsigned long long)(mfsDate? mfs_time(mfsDate) : 0));
+    hdr.typeflag = type;
+    memcpy(hdr.magic, "ustar", 6);
+    memcpy(hdr.version, "00", 2);
+
+    // checksum counts its own field as spaces
+    unsigned int sum = 0;
+    memset(hdr.chksum, ' ', sizeof hdr.chksum);
+    for(size_t i=0; i < sizeof hdr; i++) sum += ((uint8_t*)&hdr)[i];
+    sprintf(hdr.chksum, "%06o", sum);
+    return mfs_tar_write(w, &hdr, sizeof hdr);
+}
+
+// writes a file at path, which has dirLen bytes of folder names and room for the file name
+int mfs_tar_file (MFSTarWriter *w, MFSDirectoryRecord *rec, char *path, size_t dirLen) {
+    MFSVolume *vol = w->vol;
+    int mode = (rec->flFlags & 0x01)? 0444 : 0644;
+    MFSFork *fk = NULL;
+    const char *name = mfs_utf8name(rec);
+    int longPath = (dirLen + strlen(name) > 100);
+
+    if (w->flags & MFS_TAR_APPLEDOUBLE) {
+        // ._name with Finder info and resource fork
+        sprintf(path + dirLen, "._%s", name);
+        for(char *p = path + dirLen; *p; p++) if (*p == '/') *p = ':';
+        fk = mfs_fkopen(vol, rec, kMFSForkAppleDouble, 0);
+        if (fk == NULL) return -1;
+        size_t size = mfs_fksize(fk);
+        if ((dirLen + strlen(path + dirLen) > 100) &&
+            (-1 == mfs_tar_header(w, "././@PaxHeader", 'x', mfs_tar_record_len(4, strlen(path)), 0644, rec->flMdDat) ||
+             -1 == mfs_tar_record(w, "path", path, strlen(path)) ||
+             -1 == mfs_tar_pad(w, mfs_tar_record_len(4, strlen(path))))) goto error;
+        if (-1 == mfs_tar_header(w, path, '0', size, mode, rec->flMdDat) ||
+            -1 == mfs_tar_fork(w, fk, size) ||
+            -1 == mfs_tar_pad(w, size)) goto error;
+        mfs_fkclose(fk);
+        fk = NULL;
+    }
+    strcpy(path + dirLen, name);
+    for(char *p = path + dirLen; *p; p++) if (*p == '/') *p = ':';
+
+    // extended header with path and attributes
+    uint8_t finderInfo[32];
+    memset(finderInfo, 0, sizeof finderInfo);
+    memcpy(finderInfo, &rec->flUsrWds, sizeof(MFSFInfo));
+    int xattrs = !(w->flags & MFS_TAR_APPLEDOUBLE);
+    size_t paxLen = 0;
+    if (longPath) paxLen += mfs_tar_record_len(4, strlen(path));
+    if (xattrs) paxLen += mfs_tar_record_len(strlen("SCHILY.xattr.com.apple.FinderInfo"), sizeof finderInfo);
+    if (xattrs && rec->flRLgLen) paxLen += mfs_tar_record_len(strlen("SCHILY.xattr.com.apple.ResourceFork"), rec->flRLgLen);
+    if (paxLen) {
+        if (-1 == mfs_tar_header(w, "././@PaxHeader", 'x', paxLen, 0644, rec->flMdDat)) goto error;
+        if (longPath && -1 == mfs_tar_record(w, "path", path, strlen(path))) goto error;
+        if (xattrs && -1 == mfs_tar_record(w, "SCHILY.xattr.com.apple.FinderInfo", finderInfo, sizeof finderInfo)) goto error;
+        if (xattrs && rec->flRLgLen) {
+            fk = mfs_fkopen(vol, rec, kMFSForkRsrc, 0);
+            if (fk == NULL ||
+                -1 == mfs_tar_record(w, "SCHILY.xattr.com.apple.ResourceFork", NULL, rec->flRLgLen) ||
+                -1 == mfs_tar_fork(w, fk, rec->flRLgLen) ||
+                -1 == mfs_tar_write(w, "\n", 1)) goto error;
+            mfs_fkclose(fk);
+            fk = NULL;
+        }
+        if (-1 == mfs_tar_pad(w, paxLen)) goto error;
+    }
+
+    // data fork
+    fk = mfs_fkopen(vol, rec, kMFSForkData, 0);
+    if (fk == NULL ||
+        -1 == mfs_tar_header(w, path, '0', rec->flLgLen, mode, rec->flMdDat) ||
+        -1 == mfs_tar_fork(w, fk, rec->flLgLen) ||
+        -1 == mfs_tar_pad(w, rec->flLgLen)) goto error;
+    mfs_fkclose(fk);
+    return 0;
+error:
+    if (fk) mfs_fkclose(fk);
+    return -1;
+}
+
+// files in a folder, then its subfolders
+int mfs_tar_folder (MFSTarWriter *w, int16_t folder, char *path, size_t dirLen) {
+    MFSVolume *vol = w->vol;
+    for(size_t i=0; vol->directory[i]; i++) {
+        if (w->done[i] || (int16_t)ntohs(vol->directory[i]->flUsrWds.folder) != folder) continue;
+        w->done[i] = 1;
+        if (-1 == mfs_tar_file(w, vol->directory[i], path, dirLen)) return -1;
+    }
+    for(size_t f=0; f < vol->numFolders; f++) {
+        MFSFolder *fd = &vol->folders[f];
+        if (w->visited[f] || fd->fdParent != folder || fd->fdID == folder) continue;
+        w->visited[f] = 1;
+        size_t len = sprintf(path + dirLen, "%s/", fd->fdUName);
+        // '/' in names would be taken as a separator
+        for(char *p = path + dirLen; p < path + dirLen + len - 1; p++) if (*p == '/') *p = ':';
+        if (dirLen + len > 100 &&
+            (-1 == mfs_tar_header(w, "././@PaxHeader", 'x', mfs_tar_record_len(4, dirLen + len), 0644, fd->fdMdDat) ||
+             -1 == mfs_tar_record(w, "path", path, dirLen + len) ||
+             -1 == mfs_tar_pad(w, mfs_tar_record_len(4, dirLen + len)))) return -1;
+        if (-1 == mfs_tar_header(w, path, '5', 0, 0755, fd->fdMdDat)) return -1;
+        if (-1 == mfs_tar_folder(w, fd->fdID, path, dirLen + len)) return -1;
+    }
+    return 0;
+}
+
+// writes the volume to fd as a tar stream
+int mfs_tar (MFSVolume *vol, int fd, int flags) {
+    static const uint8_t zeros[2*kMFSTarBlockSize];
+    MFSTarWriter w;
+    size_t numRecords;
+    if (vol == NULL || fd < 0) {errno = EINVAL; return -1;}
+    for(numRecords = 0; vol->directory[numRecords]; numRecords++);
+    memset(&w, 0, sizeof w);
+    w.vol = vol;
+    w.fd = fd;
+    w.flags = flags;
+    w.buf = mfs_malloc(vol, kMFSTarBufferSize);
+    w.done = mfs_calloc(vol, numRecords + vol->numFolders + 1, 1);
+    w.visited = w.done + numRecords;
+    // every folder name, and a file name with ._
+    char *path = mfs_malloc(vol, vol->numFolders * sizeof(((MFSFolder*)0)->fdUName) + 2 + kMFSTarNameMax);
+    if (w.buf == NULL || w.done == NULL || path == NULL) goto error;
+    path[0] = '\0';
+    for(size_t f=0; f < vol->numFolders; f++) if (vol->folders[f].fdID == kMFSFolderRoot) w.visited[f] = 1;
+
+    // the root folder, Desktop and Trash, then files in unknown folders, like mfs_defrag
+    if (-1 == mfs_tar_folder(&w, kMFSFolderRoot, path, 0) ||
+        -1 == mfs_tar_folder(&w, kMFSFolderDesktop, path, 0) ||
+        -1 == mfs_tar_folder(&w, kMFSFolderTrash, path, 0)) goto error;
+    for(size_t i=0; i < numRecords; i++)
+        if (!w.done[i] && -1 == mfs_tar_file(&w, vol->directory[i], path, 0)) goto error;
+    if (-1 == mfs_tar_write(&w, zeros, sizeof zeros) || -1 == mfs_tar_flush(&w)) goto error;
+
+    mfs_free(vol, w.buf);
+    mfs_free(vol, w.done);
+    mfs_free(vol, path);
+    return 0;
+error:
+    mfs_free(vol, w.buf);
+    mfs_free(vol, w.done);
+    mfs_free(vol, path);
+    return -1;
+}
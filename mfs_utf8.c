@@ -0,0 +1,176 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// MacRoman <-> UTF-8 conversion. ':' and '/' are swapped, like the Mac OS X
+// Finder does, so UTF-8 names can be used as path components.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mfs.h"
+#include "mfs_private.h"
+
+// Unicode equivalents of MacRoman 0x80-0xFF
+const uint16_t mfs_chars_unicode[128] = {
+    0x00C4, 0x00C5, 0x00C7, 0x00C9, 0x00D1, 0x00D6, 0x00DC, 0x00E1,
+    0x00E0, 0x00E2, 0x00E4, 0x00E3, 0x00E5, 0x00E7, 0x00E9, 0x00E8,
+    0x00EA, 0x00EB, 0x00ED, 0x00EC, 0x00EE, 0x00EF, 0x00F1, 0x00F3,
+    0x00F2, 0x00F4, 0x00F6, 0x00F5, 0x00FA, 0x00F9, 0x00FB, 0x00FC,
+    0x2020, 0x00B0, 0x00A2, 0x00A3, 0x00A7, 0x2022, 0x00B6, 0x00DF,
+    0x00AE, 0x00A9, 0x2122, 0x00B4, 0x00A8, 0x2260, 0x00C6, 0x00D8,
+    0x221E, 0x00B1, 0x2264, 0x2265, 0x00A5, 0x00B5, 0x2202, 0x2211,
+    0x220F, 0x03C0, 0x222B, 0x00AA, 0x00BA, 0x03A9, 0x00E6, 0x00F8,
+    0x00BF, 0x00A1, 0x00AC, 0x221A, 0x0192, 0x2248, 0x2206, 0x00AB,
+    0x00BB, 0x2026, 0x00A0, 0x00C0, 0x00C3, 0x00D5, 0x0152, 0x0153,
+    0x2013, 0x2014, 0x201C, 0x201D, 0x2018, 0x2019, 0x00F7, 0x25CA,
+    0x00FF, 0x0178, 0x2044, 0x20AC, 0x2039, 0x203A, 0xFB01, 0xFB02,
+    0x2021, 0x00B7, 0x201A, 0x201E, 0x2030, 0x00C2, 0x00CA, 0x00C1,
+    0x00CB, 0x00C8, 0x00CD, 0x00CE, 0x00CF, 0x00CC, 0x00D3, 0x00D4,
+    0xF8FF, 0x00D2, 0x00DA, 0x00DB, 0x00D9, 0x0131, 0x02C6, 0x02DC,
+    0x00AF, 0x02D8, 0x02D9, 0x02DA, 0x00B8, 0x02DD, 0x02DB, 0x02C7
+};
+
+// private functions
+size_t mfs_utf8_char (uint8_t c, char *dst);
+int mfs_utf8_decode (const uint8_t **s);
+
+// UTF-8 encoding of a MacRoman character, 1 to 3 bytes
+size_t mfs_utf8_char (uint8_t c, char *dst) {
+    if (c == ':') c = '/';
+    else if (c == '/') c = ':';
+    if (c < 0x80) {
+        dst[0] = c;
+        return 1;
+    }
+    uint16_t u = mfs_chars_unicode[c - 0x80];
+    if (u < 0x800) {
+        dst[0] = 0xC0 | (u >> 6);
+        dst[1] = 0x80 | (u & 0x3F);
+        return 2;
+    }
+    dst[0] = 0xE0 | (u >> 12);
+    dst[1] = 0x80 | ((u >> 6) & 0x3F);
+    dst[2] = 0x80 | (u & 0x3F);
+    return 3;
+}
+
+// next character of a UTF-8 string as MacRoman, 0 at the end, -1 if it's invalid or has no MacRoman equivalent
+int mfs_utf8_decode (const uint8_t **s) {
+    const uint8_t *p = *s;
+    uint32_t u;
+    if (p[0] < 0x80) {
+        u = p[0];
+        if (u) p++;
+    } else if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+        u = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+        if (u < 0x80) return -1; // overlong, C0 80 would end the name
+        p += 2;
+    } else if ((p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+        u = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        if (u < 0x800 || (u >= 0xD800 && u < 0xE000)) return -1; // overlong or surrogate
+        p += 3;
+    } else return -1;
+    *s = p;
+
+    if (u == ':') return '/';
+    if (u == '/') return ':';
+    if (u < 0x80) return u;
+    for(int i=0; i < 128; i++) if (mfs_chars_unicode[i] == u) return 0x80 + i;
+    return -1;
+}
+
+// returns the length of the result, which is truncated to fit in size bytes
+size_t mfs_utf8_from_macroman (char *dst, size_t size, const char *src) {
+    char buf[3];
+    size_t len = 0, n;
+    if (size == 0) return 0;
+    for(const uint8_t *s = (const uint8_t*)src; *s; s++) {
+        n = mfs_utf8_char(*s, buf);
+        if (len + n >= size) break;
+        memcpy(dst + len, buf, n);
+        len += n;
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+// returns the length of the result, or -1 and sets errno if it doesn't fit or can't be represented
+ssize_t mfs_macroman_from_utf8 (char *dst, size_t size, const char *src) {
+    const uint8_t *s = (const uint8_t*)src;
+    size_t len = 0;
+    int c;
+    while ((c = mfs_utf8_decode(&s)) > 0) {
+        if (len + 1 >= size) {errno = ENAMETOOLONG; return -1;}
+        dst[len++] = c;
+    }
+    if (c == -1) {errno = EILSEQ; return -1;}
+    if (size) dst[len] = '\0';
+    return len;
+}
+
+// converted once when the directory is read, it's stored after flCName
+const char * mfs_utf8name (MFSDirectoryRecord *rec) {
+    return rec->flCName + rec->flNam[0] + 1;
+}
+
+// size of a record in the directory arena, with both names
+size_t mfs_directory_record_size (MFSDirectoryRecord *rec) {
+    return 52 + rec->flNam[0] + strlen(mfs_utf8name(rec)) + 1;
+}
+
+// like mfs_fneq, comparing a MacRoman name to a UTF-8 one
+int mfs_fneq_utf8 (const uint8_t *name, const uint8_t *uname) {
+    int c;
+    while ((c = mfs_utf8_decode(&uname)) > 0)
+        if (mfs_chars_toupper[*name++] != mfs_chars_toupper[c]) return 0;
+    return c == 0 && *name == 0;
+}
+
+// hashes the UTF-8 name as its MacRoman equivalent, to use the same index as mfs_directory_lookup
+MFSDirectoryRecord* mfs_directory_lookup_utf8 (MFSVolume *vol, const char *name) {
+    const uint8_t *s = (const uint8_t*)name;
+    uint32_t hash = 2166136261u;
+    int c;
+    while ((c = mfs_utf8_decode(&s)) > 0) {
+        hash ^= mfs_chars_toupper[c];
+        hash *= 16777619u;
+    }
+    if (c == -1) return NULL;
+
+    MFSDirectoryRecord *rec;
+    if (vol->nameHash == NULL) {
+        for(size_t i=0; (rec = vol->directory[i]); i++)
+            if (mfs_fneq_utf8((const uint8_t*)rec->flCName, (const uint8_t*)name)) return rec;
+        return NULL;
+    }
+    size_t mask = vol->nameHashSize-1;
+    for(size_t slot = hash & mask; vol->nameHash[slot]; slot = (slot+1) & mask) {
+        rec = vol->directory[vol->nameHash[slot]-1];
+        if (mfs_fneq_utf8((const uint8_t*)rec->flCName, (const uint8_t*)name)) return rec;
+    }
+    return NULL;
+}
+
+MFSFolder* mfs_folder_find_utf8name (MFSVolume *vol, const char *name) {
+    if (vol->folders == NULL) return NULL;
+    for(size_t i=0; i < vol->numFolders; i++)
+        if (mfs_fneq_utf8((const uint8_t*)vol->folders[i].fdCNam, (const uint8_t*)name)) return &vol->folders[i];
+    return NULL;
+}
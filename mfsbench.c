@@ -0,0 +1,201 @@
+/*
+ * mfsbench - concurrent fork reads on one Macintosh MFS volume
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Every fork is read once to get its contents, then each thread opens its own
+// forks on the same volume and reads them in pieces of varying size and offset,
+// checking every byte against the first read. Comments are fetched too, so the
+// Desktop file is opened by whichever thread gets there first.
+
+// getopt and rand_r aren't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mfs.h"
+
+#define kMFSBenchMaxRead    (64*1024)
+
+struct MFSBenchFork {
+    MFSDirectoryRecord  *rec;
+    int                 mode;
+    size_t              size;
+    uint8_t             *data;
+};
+
+struct MFSBenchThread {
+    pthread_t           thread;
+    int                 num;
+    size_t              bytes;
+    size_t              reads;
+    size_t              errors;
+};
+
+MFSVolume *vol;
+struct MFSBenchFork *forks;
+size_t numForks, passes = 20;
+
+void usage (const char *prog) {
+    fprintf(stderr, "usage: %s [-o offset] [-t threads] [-n passes] image.img\n", prog);
+    exit(1);
+}
+
+double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// reads a fork whole, to check against
+int load_fork (struct MFSBenchFork *bf) {
+    MFSFork *fk = mfs_fkopen(vol, bf->rec, bf->mode, 0);
+    if (fk == NULL) return -1;
+    bf->size = mfs_fksize(fk);
+    bf->data = malloc(bf->size + 1);
+    if (bf->data == NULL || mfs_fkread_at(fk, bf->size, 0, bf->data) != (int)bf->size) {
+        mfs_fkclose(fk);
+        return -1;
+    }
+    mfs_fkclose(fk);
+    return 0;
+}
+
+void * bench_thread (void *arg) {
+    struct MFSBenchThread *t = arg;
+    uint8_t *buf = malloc(kMFSBenchMaxRead);
+    unsigned int seed = t->num + 1;
+    if (buf == NULL) {
+        t->errors++;
+        return NULL;
+    }
+
+    for(size_t pass=0; pass < passes; pass++) {
+        // each thread starts at a different fork, so they overlap in every way
+        for(size_t n=0; n < numForks; n++) {
+            struct MFSBenchFork *bf = &forks[(n + t->num) % numForks];
+            MFSFork *fk = mfs_fkopen(vol, bf->rec, bf->mode, 0);
+            if (fk == NULL) {
+                t->errors++;
+                continue;
+            }
+            // alternate between sequential and scattered reads
+            size_t offset = (pass % 2 || bf->size == 0)? 0 : rand_r(&seed) % bf->size;
+            for(size_t done = 0, size; done < bf->size; done += size) {
+                size = 1 + rand_r(&seed) % kMFSBenchMaxRead;
+                if (offset + size > bf->size) size = bf->size - offset;
+                int rb = mfs_fkread_at(fk, size, offset, buf);
+                if (rb != (int)size || memcmp(buf, bf->data + offset, size)) t->errors++;
+                t->bytes += size;
+                t->reads++;
+                offset = (offset + size < bf->size)? offset + size : 0;
+            }
+            mfs_fkclose(fk);
+            free(mfs_comment(vol, bf->rec));
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int main (int argc, char *argv[]) {
+    size_t offset = 0;
+    int numThreads = 8, ch;
+    while ((ch = getopt(argc, argv, "o:t:n:")) != -1) {
+        switch (ch) {
+            case 'o':
+                offset = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'n':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || numThreads < 1) usage(argv[0]);
+    const char *path = argv[optind];
+
+    vol = mfs_vopen(path, offset, 0);
+    if (vol == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // data and resource fork of every file
+    size_t numRecords;
+    for(numRecords = 0; vol->directory[numRecords]; numRecords++);
+    forks = calloc(2*numRecords + 1, sizeof(struct MFSBenchFork));
+    if (forks == NULL) return 1;
+    for(size_t i=0; i < numRecords; i++) {
+        for(int mode = kMFSForkData; mode <= kMFSForkRsrc; mode++) {
+            struct MFSBenchFork *bf = &forks[numForks];
+            bf->rec = vol->directory[i];
+            bf->mode = mode;
+            // files without a resource fork can't open one
+            if (mode == kMFSForkRsrc && bf->rec->flRLgLen == 0) continue;
+            if (-1 == load_fork(bf)) {
+                fprintf(stderr, "%s: %s: %s\n", path, mfs_utf8name(bf->rec), strerror(errno));
+                return 1;
+            }
+            numForks++;
+        }
+    }
+    if (numForks == 0) {
+        fprintf(stderr, "%s: no files\n", path);
+        return 1;
+    }
+
+    struct MFSBenchThread *threads = calloc(numThreads, sizeof(struct MFSBenchThread));
+    if (threads == NULL) return 1;
+    double start = now();
+    for(int i=0; i < numThreads; i++) {
+        threads[i].num = i;
+        int err = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    size_t bytes = 0, reads = 0, errors = 0;
+    for(int i=0; i < numThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        bytes += threads[i].bytes;
+        reads += threads[i].reads;
+        errors += threads[i].errors;
+    }
+    double elapsed = now() - start;
+
+    printf("%d threads, %zu forks, %zu reads, %.1f MB in %.3fs: %.1f MB/s, %.0f reads/s, %zu errors\n",
+        numThreads, numForks, reads, bytes / 1e6, elapsed, bytes / 1e6 / elapsed, reads / elapsed, errors);
+    if (-1 == mfs_vclose(vol)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        errors++;
+    }
+    for(size_t n=0; n < numForks; n++) free(forks[n].data);
+    free(forks);
+    free(threads);
+    return errors? 1 : 0;
+}
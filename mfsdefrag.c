@@ -0,0 +1,88 @@
+/*
+ * mfsdefrag - write a defragmented copy of a Macintosh MFS volume
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// getopt isn't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "mfs.h"
+
+void usage (const char *prog) {
+    fprintf(stderr, "usage: %s [-o offset] source.img dest.img\n", prog);
+    exit(1);
+}
+
+void report (const char *label, MFSVolume *vol) {
+    MFSAllocReport *r = mfs_alloc_report(vol);
+    if (r == NULL) return;
+    printf("%s: %zu/%zu forks fragmented, %zu extents, %.1f blocks/extent, largest free run %zu of %zu free blocks\n",
+        label, r->fragmentedForks, r->numForks, r->numExtents, r->avgExtentLength, r->largestFree, r->freeBlocks);
+    mfs_alloc_report_free(r);
+}
+
+int main (int argc, char *argv[]) {
+    size_t offset = 0;
+    int ch;
+    while ((ch = getopt(argc, argv, "o:")) != -1) {
+        switch (ch) {
+            case 'o':
+                offset = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) usage(argv[0]);
+    const char *src = argv[optind], *dst = argv[optind+1];
+
+    MFSVolume *vol = mfs_vopen(src, offset, MFS_FOLDERS);
+    if (vol == NULL) {
+        fprintf(stderr, "%s: %s\n", src, strerror(errno));
+        return 1;
+    }
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+        mfs_vclose(vol);
+        return 1;
+    }
+    report(src, vol);
+    if (-1 == mfs_defrag(vol, fd) || -1 == close(fd)) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+        mfs_vclose(vol);
+        unlink(dst);
+        return 1;
+    }
+    mfs_vclose(vol);
+
+    // check the result
+    vol = mfs_vopen(dst, 0, MFS_FOLDERS);
+    if (vol == NULL) {
+        fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+        return 1;
+    }
+    report(dst, vol);
+    mfs_vclose(vol);
+    return 0;
+}
@@ -0,0 +1,696 @@
+/*
+ * libmfs - library for reading Macintosh MFS volumes
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// Read-only FUSE filesystem for MFS images, on the libfuse 3 low-level API.
+// The folder tree is worked out once at mount, so every request is answered
+// from memory without locks, and requests are served from several threads.
+// Reads reply with the fork's segments, which libfuse splices from the image
+// when the kernel allows it. Nothing changes while mounted, so entries,
+// attributes and file contents are all left in the kernel's caches.
+
+#define FUSE_USE_VERSION 35
+// S_IFDIR, S_IFREG and strdup aren't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+#include "mfs.h"
+
+// seconds the kernel can keep names and attributes
+#define kMFSFuseTimeout     86400.0
+
+// inode numbers: FUSE_ROOT_ID is the root, the rest are a kind and an index
+#define kMFSFuseFolder      0x10000     // index in vol->folders
+#define kMFSFuseFile        0x20000     // index in vol->directory
+#define kMFSFuseFileAD      0x30000     // ._ file for a file, with -o appledouble
+#define kMFSFuseFolderAD    0x40000     // ._ file for a folder
+#define kMFSFuseKind(ino)   ((ino) & ~(fuse_ino_t)0xFFFF)
+#define kMFSFuseIndex(ino)  ((size_t)((ino) & 0xFFFF))
+
+// only the user namespace is open to other names on Linux
+#if defined(__APPLE__)
+#define kMFSFuseXattrPrefix ""
+#else
+#define kMFSFuseXattrPrefix "user."
+#endif
+#define kMFSFuseFinderInfo      kMFSFuseXattrPrefix "com.apple.FinderInfo"
+#define kMFSFuseResourceFork    kMFSFuseXattrPrefix "com.apple.ResourceFork"
+
+// a ':' in an MFS name is '/' in UTF-8, which can't be in a host name, so it's
+// shown as DIVISION SLASH, which isn't in MacRoman
+#define kMFSFuseSlash       "\xE2\x88\x95"
+
+// longest name, with ._ in front and every character taking 3 bytes
+#define kMFSFuseNameMax     (2 + 3*255 + 1)
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+struct MFSFuse {
+    MFSVolume   *vol;
+    char        *image;
+    size_t      offset;         // -o offset
+    int         appleDouble;    // -o appledouble
+    int         index;          // -o index
+    int         fd;             // image to splice from, or -1
+    uid_t       uid;
+    gid_t       gid;
+    size_t      numFiles;
+    fuse_ino_t  *fileParent;    // folder inode of each file
+    fuse_ino_t  *folderParent;  // folder inode of each folder, 0 for the root folder
+    size_t      *childStart;    // children of each directory, root first,
+    fuse_ino_t  *children;      // are children[childStart[d]] to children[childStart[d+1]]
+};
+typedef struct MFSFuse MFSFuse;
+
+// private functions
+fuse_ino_t mfsfuse_folder_ino (MFSFuse *fs, int16_t fdID);
+ssize_t mfsfuse_dir (MFSFuse *fs, fuse_ino_t ino);
+fuse_ino_t mfsfuse_parent (MFSFuse *fs, fuse_ino_t ino);
+MFSFolder * mfsfuse_folder (MFSFuse *fs, fuse_ino_t ino);
+ssize_t mfsfuse_file_index (MFSFuse *fs, MFSDirectoryRecord *rec);
+const char * mfsfuse_host_name (const char *prefix, const char *name, char *buf);
+const char * mfsfuse_name (MFSFuse *fs, fuse_ino_t ino, char *buf);
+int mfsfuse_build (MFSFuse *fs);
+void mfsfuse_free (MFSFuse *fs);
+int mfsfuse_stat (MFSFuse *fs, fuse_ino_t ino, struct stat *st);
+fuse_ino_t mfsfuse_find (MFSFuse *fs, fuse_ino_t parent, const char *name);
+int mfsfuse_finderinfo (MFSFuse *fs, fuse_ino_t ino, void *buf);
+
+// files and folders are in their folder if it's known, otherwise in the root
+fuse_ino_t mfsfuse_folder_ino (MFSFuse *fs, int16_t fdID) {
+    if (fdID == kMFSFolderRoot) return FUSE_ROOT_ID;
+    MFSFolder *folder = mfs_folder_find(fs->vol, fdID);
+    if (folder == NULL) return FUSE_ROOT_ID;
+    return kMFSFuseFolder + (folder - fs->vol->folders);
+}
+
+// index in childStart, or -1 if it's not a directory
+ssize_t mfsfuse_dir (MFSFuse *fs, fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return 0;
+    if (kMFSFuseKind(ino) != kMFSFuseFolder || kMFSFuseIndex(ino) >= fs->vol->numFolders) return -1;
+    if (fs->folderParent[kMFSFuseIndex(ino)] == 0) return -1;
+    return kMFSFuseIndex(ino) + 1;
+}
+
+fuse_ino_t mfsfuse_parent (MFSFuse *fs, fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return FUSE_ROOT_ID;
+    switch (kMFSFuseKind(ino)) {
+        case kMFSFuseFolder:
+        case kMFSFuseFolderAD:
+            return fs->folderParent[kMFSFuseIndex(ino)];
+        default:
+            return fs->fileParent[kMFSFuseIndex(ino)];
+    }
+}
+
+// folder for a directory inode or its ._ file, NULL for the root if it has no FOBJ
+MFSFolder * mfsfuse_folder (MFSFuse *fs, fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return mfs_folder_find(fs->vol, kMFSFolderRoot);
+    return &fs->vol->folders[kMFSFuseIndex(ino)];
+}
+
+// records are stored in directory order, so their addresses are sorted
+ssize_t mfsfuse_file_index (MFSFuse *fs, MFSDirectoryRecord *rec) {
+    MFSDirectoryRecord **dir = fs->vol->directory;
+    size_t lo = 0, hi = fs->numFiles;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((uintptr_t)dir[mid] < (uintptr_t)rec) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < fs->numFiles && dir[lo] == rec)? (ssize_t)lo : -1;
+}
+
+// prefix and UTF-8 name as the host sees it, buf has kMFSFuseNameMax bytes
+const char * mfsfuse_host_name (const char *prefix, const char *name, char *buf) {
+    if (*prefix == '\0' && strchr(name, '/') == NULL) return name;
+    char *p = buf + sprintf(buf, "%s", prefix);
+    for(; *name; name++) {
+        if (*name == '/') p += sprintf(p, "%s", kMFSFuseSlash);
+        else *p++ = *name;
+    }
+    *p = '\0';
+    return buf;
+}
+
+// name of an inode in its directory, buf has kMFSFuseNameMax bytes
+const char * mfsfuse_name (MFSFuse *fs, fuse_ino_t ino, char *buf) {
+    size_t i = kMFSFuseIndex(ino);
+    switch (kMFSFuseKind(ino)) {
+        case kMFSFuseFolder:
+            return mfsfuse_host_name("", fs->vol->folders[i].fdUName, buf);
+        case kMFSFuseFile:
+            return mfsfuse_host_name("", mfs_utf8name(fs->vol->directory[i]), buf);
+        case kMFSFuseFolderAD:
+            return mfsfuse_host_name("._", fs->vol->folders[i].fdUName, buf);
+        case kMFSFuseFileAD:
+            return mfsfuse_host_name("._", mfs_utf8name(fs->vol->directory[i]), buf);
+    }
+    return NULL;
+}
+
+// parents and children of every folder
+int mfsfuse_build (MFSFuse *fs) {
+    MFSVolume *vol = fs->vol;
+    size_t numFolders = vol->numFolders;
+    size_t perItem = fs->appleDouble? 2 : 1;
+    for(fs->numFiles = 0; vol->directory[fs->numFiles]; fs->numFiles++);
+    if (fs->numFiles > 0xFFFF || numFolders > 0xFFFF) {errno = EFBIG; return -1;}
+    fs->fileParent = calloc(fs->numFiles + 1, sizeof(fuse_ino_t));
+    fs->folderParent = calloc(numFolders + 1, sizeof(fuse_ino_t));
+    fs->childStart = calloc(numFolders + 2, sizeof(size_t));
+    fs->children = calloc(perItem*(fs->numFiles + numFolders) + 1, sizeof(fuse_ino_t));
+    size_t *next = calloc(numFolders + 1, sizeof(size_t));
+    if (!fs->fileParent || !fs->folderParent || !fs->childStart || !fs->children || !next) {
+        free(next);
+        return -1;
+    }
+
+    // parents, the root folder has none and folders can't be in themselves
+    for(size_t i=0; i < fs->numFiles; i++)
+        fs->fileParent[i] = mfsfuse_folder_ino(fs, ntohs(vol->directory[i]->flUsrWds.folder));
+    for(size_t f=0; f < numFolders; f++) {
+        MFSFolder *folder = &vol->folders[f];
+        if (folder->fdID == kMFSFolderRoot) continue;
+        fs->folderParent[f] = (folder->fdParent == folder->fdID)? FUSE_ROOT_ID : mfsfuse_folder_ino(fs, folder->fdParent);
+    }
+
+    // count children, then fill them in: folders first, then files
+    for(size_t f=0; f < numFolders; f++)
+        if (fs->folderParent[f]) fs->childStart[mfsfuse_dir(fs, fs->folderParent[f]) + 1] += perItem;
+    for(size_t i=0; i < fs->numFiles; i++)
+        fs->childStart[mfsfuse_dir(fs, fs->fileParent[i]) + 1] += perItem;
+    for(size_t d=0; d <= numFolders; d++) {
+        fs->childStart[d+1] += fs->childStart[d];
+        next[d] = fs->childStart[d];
+    }
+    for(size_t f=0; f < numFolders; f++) {
+        if (fs->folderParent[f] == 0) continue;
+        size_t d = mfsfuse_dir(fs, fs->folderParent[f]);
+        fs->children[next[d]++] = kMFSFuseFolder + f;
+        if (fs->appleDouble) fs->children[next[d]++] = kMFSFuseFolderAD + f;
+    }
+    for(size_t i=0; i < fs->numFiles; i++) {
+        size_t d = mfsfuse_dir(fs, fs->fileParent[i]);
+        fs->children[next[d]++] = kMFSFuseFile + i;
+        if (fs->appleDouble) fs->children[next[d]++] = kMFSFuseFileAD + i;
+    }
+    free(next);
+    return 0;
+}
+
+void mfsfuse_free (MFSFuse *fs) {
+    free(fs->fileParent);
+    free(fs->folderParent);
+    free(fs->childStart);
+    free(fs->children);
+}
+
+int mfsfuse_stat (MFSFuse *fs, fuse_ino_t ino, struct stat *st) {
+    MFSVolume *vol = fs->vol;
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino;
+    st->st_uid = fs->uid;
+    st->st_gid = fs->gid;
+    st->st_blksize = vol->mdb.drAlBlkSiz;
+
+    ssize_t d = mfsfuse_dir(fs, ino);
+    if (d != -1) {
+        MFSFolder *folder = mfsfuse_folder(fs, ino);
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        for(size_t c = fs->childStart[d]; c < fs->childStart[d+1]; c++)
+            if (kMFSFuseKind(fs->children[c]) == kMFSFuseFolder) st->st_nlink++;
+        st->st_mtime = st->st_ctime = st->st_atime = mfs_time(folder? folder->fdMdDat : vol->mdb.drCrDate);
+        return 0;
+    }
+
+    size_t i = kMFSFuseIndex(ino);
+    MFSDirectoryRecord *rec;
+    switch (kMFSFuseKind(ino)) {
+        case kMFSFuseFile:
+            if (i >= fs->numFiles) break;
+            rec = vol->directory[i];
+            st->st_size = rec->flLgLen;
+            st->st_blocks = rec->flPyLen / 512;
+            st->st_mtime = st->st_ctime = st->st_atime = mfs_time(rec->flMdDat);
+            st->st_mode = S_IFREG | 0444;
+            st->st_nlink = 1;
+            return 0;
+        case kMFSFuseFileAD:
+            if (!fs->appleDouble || i >= fs->numFiles) break;
+            rec = vol->directory[i];
+            st->st_size = kAppleDoubleHeaderLength + rec->flRLgLen;
+            st->st_blocks = (st->st_size + 511) / 512;
+            st->st_mtime = st->st_ctime = st->st_atime = mfs_time(rec->flMdDat);
+            st->st_mode = S_IFREG | 0444;
+            st->st_nlink = 1;
+            return 0;
+        case kMFSFuseFolderAD:
+            if (!fs->appleDouble || i >= vol->numFolders || fs->folderParent[i] == 0) break;
+            st->st_size = kAppleDoubleHeaderLength;
+            st->st_blocks = (st->st_size + 511) / 512;
+            st->st_mtime = st->st_ctime = st->st_atime = mfs_time(vol->folders[i].fdMdDat);
+            st->st_mode = S_IFREG | 0444;
+            st->st_nlink = 1;
+            return 0;
+    }
+    return -1;
+}
+
+// inode of a name in a folder, or 0 if there is none
+fuse_ino_t mfsfuse_find (MFSFuse *fs, fuse_ino_t parent, const char *name) {
+    MFSVolume *vol = fs->vol;
+    ssize_t d = mfsfuse_dir(fs, parent), i;
+    if (d == -1) return 0;
+
+    if (fs->appleDouble && name[0] == '.' && name[1] == '_') {
+        fuse_ino_t ino = mfsfuse_find(fs, parent, name + 2);
+        if (kMFSFuseKind(ino) == kMFSFuseFile) return kMFSFuseFileAD + kMFSFuseIndex(ino);
+        if (kMFSFuseKind(ino) == kMFSFuseFolder) return kMFSFuseFolderAD + kMFSFuseIndex(ino);
+        return 0;
+    }
+
+    // back to the volume's UTF-8 name
+    char volName[kMFSFuseNameMax];
+    if (strstr(name, kMFSFuseSlash)) {
+        char *p = volName;
+        if (strlen(name) >= sizeof volName) return 0;
+        while (*name) {
+            if (strncmp(name, kMFSFuseSlash, 3) == 0) {
+                *p++ = '/';
+                name += 3;
+            } else *p++ = *name++;
+        }
+        *p = '\0';
+        name = volName;
+    }
+
+    // file names are unique in the volume
+    MFSDirectoryRecord *rec = mfs_directory_lookup_utf8(vol, name);
+    if (rec && (i = mfsfuse_file_index(fs, rec)) != -1 && fs->fileParent[i] == parent) return kMFSFuseFile + i;
+
+    // folder names aren't, look for the exact name in this one before ignoring case
+    for(size_t c = fs->childStart[d]; c < fs->childStart[d+1]; c++) {
+        fuse_ino_t ino = fs->children[c];
+        if (kMFSFuseKind(ino) == kMFSFuseFolder && strcmp(vol->folders[kMFSFuseIndex(ino)].fdUName, name) == 0) return ino;
+    }
+    MFSFolder *folder = mfs_folder_find_utf8name(vol, name);
+    if (folder && fs->folderParent[folder - vol->folders] == parent) return kMFSFuseFolder + (folder - vol->folders);
+    return 0;
+}
+
+// 32 bytes of Finder info for a file or folder, returns -1 if ino has none
+int mfsfuse_finderinfo (MFSFuse *fs, fuse_ino_t ino, void *buf) {
+    memset(buf, 0, 32);
+    if (kMFSFuseKind(ino) == kMFSFuseFile) {
+        if (kMFSFuseIndex(ino) >= fs->numFiles) return -1;
+        memcpy(buf, &fs->vol->directory[kMFSFuseIndex(ino)]->flUsrWds, 16);
+        return 0;
+    }
+    if (mfsfuse_dir(fs, ino) == -1) return -1;
+    MFSFolder *folder = mfsfuse_folder(fs, ino);
+    if (folder == NULL) return -1;
+    // same as the AppleDouble header from mfs_dhopen
+    MFSFInfo finfo = {0, 0, 0, {0, 0}, 0};
+    finfo.flags = htons(folder->fdFlags);
+    finfo.loc.v = htons(folder->fdLocV);
+    finfo.loc.h = htons(folder->fdLocH);
+    memcpy(buf, &finfo, 16);
+    return 0;
+}
+
+void mfsfuse_init (void *userdata, struct fuse_conn_info *conn) {
+    // let libfuse splice replies from the image
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+void mfsfuse_lookup (fuse_req_t req, fuse_ino_t parent, const char *name) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof e);
+    e.entry_timeout = e.attr_timeout = kMFSFuseTimeout;
+    if (mfsfuse_dir(fs, parent) == -1) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    // names that aren't there are cached too, with inode 0
+    e.ino = mfsfuse_find(fs, parent, name);
+    if (e.ino) mfsfuse_stat(fs, e.ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+void mfsfuse_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    struct stat st;
+    if (-1 == mfsfuse_stat(fs, ino, &st)) fuse_reply_err(req, ENOENT);
+    else fuse_reply_attr(req, &st, kMFSFuseTimeout);
+}
+
+void mfsfuse_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    MFSVolume *vol = fs->vol;
+    struct stat st;
+    MFSFork *fk;
+    if (-1 == mfsfuse_stat(fs, ino, &st)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    size_t i = kMFSFuseIndex(ino);
+    switch (kMFSFuseKind(ino)) {
+        case kMFSFuseFile:
+            fk = mfs_fkopen(vol, vol->directory[i], kMFSForkData, 0);
+            break;
+        case kMFSFuseFileAD:
+            fk = mfs_fkopen(vol, vol->directory[i], kMFSForkAppleDouble, 0);
+            break;
+        case kMFSFuseFolderAD:
+            fk = mfs_dhopen(vol, &vol->folders[i]);
+            break;
+        default:
+            fuse_reply_err(req, EISDIR);
+            return;
+    }
+    if (fk == NULL) {
+        fuse_reply_err(req, errno? errno : EIO);
+        return;
+    }
+    fi->fh = (uintptr_t)fk;
+    // contents never change while mounted
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+// forks are sent as segments, so image data is spliced instead of copied when it can be
+void mfsfuse_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    MFSFork *fk = (MFSFork*)(uintptr_t)fi->fh;
+    size_t fkSize = mfs_fksize(fk);
+    if (off < 0 || (size_t)off >= fkSize || size == 0) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (size > fkSize - off) size = fkSize - off;
+
+    if (fs->fd == -1 && fs->vol->src.base == NULL) {
+        // no file descriptor or memory to reply from
+        void *buf = malloc(size);
+        int rb = buf? mfs_fkread_at(fk, size, off, buf) : -1;
+        if (rb == -1) fuse_reply_err(req, errno? errno : EIO);
+        else fuse_reply_buf(req, buf, rb);
+        free(buf);
+        return;
+    }
+
+    // a segment per allocation block at most, and the AppleDouble header
+    size_t maxSegs = size / fs->vol->mdb.drAlBlkSiz + 3;
+    MFSForkSegment *seg = malloc(sizeof(MFSForkSegment)*maxSegs);
+    struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf)*maxSegs);
+    ssize_t nseg = (seg && bufv)? mfs_fksegments(fk, size, off, seg, maxSegs) : -1;
+    if (nseg == -1) {
+        fuse_reply_err(req, errno? errno : EIO);
+    } else {
+        bufv->count = nseg;
+        for(ssize_t s=0; s < nseg; s++) {
+            struct fuse_buf *buf = &bufv->buf[s];
+            buf->size = seg[s].length;
+            if (seg[s].data) {
+                buf->mem = (void*)seg[s].data;
+            } else {
+                buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+                buf->fd = fs->fd;
+                buf->pos = seg[s].offset;
+            }
+        }
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    }
+    free(seg);
+    free(bufv);
+}
+
+void mfsfuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    mfs_fkclose((MFSFork*)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+void mfsfuse_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    if (mfsfuse_dir(fs, ino) == -1) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fi->keep_cache = 1;
+    fi->cache_readdir = 1;
+    fuse_reply_open(req, fi);
+}
+
+// entries are ".", ".." and the folder's children, off is the index of the next one
+void mfsfuse_readdir_common (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    ssize_t d = mfsfuse_dir(fs, ino);
+    if (d == -1) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    char hostName[kMFSFuseNameMax];
+    size_t len = 0, count = 2 + fs->childStart[d+1] - fs->childStart[d];
+    for(size_t n = (off > 0)? off : 0; n < count; n++) {
+        struct fuse_entry_param e;
+        const char *name;
+        size_t entLen;
+        memset(&e, 0, sizeof e);
+        e.entry_timeout = e.attr_timeout = kMFSFuseTimeout;
+        if (n < 2) {
+            // the kernel doesn't look these up, and wants no inode for them
+            name = n? ".." : ".";
+            mfsfuse_stat(fs, n? mfsfuse_parent(fs, ino) : ino, &e.attr);
+        } else {
+            e.ino = fs->children[fs->childStart[d] + n - 2];
+            name = mfsfuse_name(fs, e.ino, hostName);
+            mfsfuse_stat(fs, e.ino, &e.attr);
+        }
+        if (plus) entLen = fuse_add_direntry_plus(req, buf + len, size - len, name, &e, n + 1);
+        else entLen = fuse_add_direntry(req, buf + len, size - len, name, &e.attr, n + 1);
+        if (entLen > size - len) break;
+        len += entLen;
+    }
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+void mfsfuse_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    mfsfuse_readdir_common(req, ino, size, off, 0);
+}
+
+void mfsfuse_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    mfsfuse_readdir_common(req, ino, size, off, 1);
+}
+
+void mfsfuse_statfs (fuse_req_t req, fuse_ino_t ino) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    MFSMasterDirectoryBlock *mdb = &fs->vol->mdb;
+    struct statvfs st;
+    memset(&st, 0, sizeof st);
+    st.f_bsize = st.f_frsize = mdb->drAlBlkSiz;
+    st.f_blocks = mdb->drNmAlBlks;
+    st.f_bfree = st.f_bavail = mdb->drFreeBks;
+    st.f_files = fs->numFiles + fs->vol->numFolders;
+    st.f_namemax = 255;
+    fuse_reply_statfs(req, &st);
+}
+
+void mfsfuse_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    char names[sizeof kMFSFuseFinderInfo + sizeof kMFSFuseResourceFork], finfo[32];
+    size_t len = 0;
+    if (0 == mfsfuse_finderinfo(fs, ino, finfo)) {
+        memcpy(names, kMFSFuseFinderInfo, sizeof kMFSFuseFinderInfo);
+        len += sizeof kMFSFuseFinderInfo;
+    }
+    if (kMFSFuseKind(ino) == kMFSFuseFile && fs->vol->directory[kMFSFuseIndex(ino)]->flRLgLen) {
+        memcpy(names + len, kMFSFuseResourceFork, sizeof kMFSFuseResourceFork);
+        len += sizeof kMFSFuseResourceFork;
+    }
+    if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < len) fuse_reply_err(req, ERANGE);
+    else fuse_reply_buf(req, names, len);
+}
+
+void mfsfuse_getxattr (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    MFSFuse *fs = fuse_req_userdata(req);
+    char finfo[32];
+    if (strcmp(name, kMFSFuseFinderInfo) == 0 && 0 == mfsfuse_finderinfo(fs, ino, finfo)) {
+        if (size == 0) fuse_reply_xattr(req, sizeof finfo);
+        else if (size < sizeof finfo) fuse_reply_err(req, ERANGE);
+        else fuse_reply_buf(req, finfo, sizeof finfo);
+        return;
+    }
+    if (strcmp(name, kMFSFuseResourceFork) || kMFSFuseKind(ino) != kMFSFuseFile) {
+        fuse_reply_err(req, ENOATTR);
+        return;
+    }
+
+    // the whole resource fork, xattrs can't be read in parts
+    MFSDirectoryRecord *rec = fs->vol->directory[kMFSFuseIndex(ino)];
+    size_t len = rec->flRLgLen;
+    if (len == 0) fuse_reply_err(req, ENOATTR);
+    else if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < len) fuse_reply_err(req, ERANGE);
+    else {
+        MFSFork *fk = mfs_fkopen(fs->vol, rec, kMFSForkRsrc, 0);
+        void *buf = fk? malloc(len) : NULL;
+        if (buf && mfs_fkread_at(fk, len, 0, buf) == (int)len) fuse_reply_buf(req, buf, len);
+        else fuse_reply_err(req, errno? errno : EIO);
+        free(buf);
+        if (fk) mfs_fkclose(fk);
+    }
+}
+
+const struct fuse_lowlevel_ops mfsfuse_ops = {
+    .init           = mfsfuse_init,
+    .lookup         = mfsfuse_lookup,
+    .getattr        = mfsfuse_getattr,
+    .open           = mfsfuse_open,
+    .read           = mfsfuse_read,
+    .release        = mfsfuse_release,
+    .opendir        = mfsfuse_opendir,
+    .readdir        = mfsfuse_readdir,
+    .readdirplus    = mfsfuse_readdirplus,
+    .statfs         = mfsfuse_statfs,
+    .getxattr       = mfsfuse_getxattr,
+    .listxattr      = mfsfuse_listxattr,
+};
+
+const struct fuse_opt mfsfuse_opts[] = {
+    {"offset=%zu", offsetof(MFSFuse, offset), 0},
+    {"appledouble", offsetof(MFSFuse, appleDouble), 1},
+    {"index", offsetof(MFSFuse, index), 1},
+    FUSE_OPT_END
+};
+
+// the first argument that isn't an option is the image, the mount point is left for libfuse
+int mfsfuse_opt_proc (void *data, const char *arg, int key, struct fuse_args *outargs) {
+    MFSFuse *fs = data;
+    if (key == FUSE_OPT_KEY_NONOPT && fs->image == NULL) {
+        fs->image = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+void usage (const char *prog) {
+    printf("usage: %s [options] image mountpoint\n\n", prog);
+    printf("MFS options:\n"
+           "    -o offset=N            volume starts N bytes into the image\n"
+           "    -o appledouble         show resource forks and Finder info as ._ files\n"
+           "    -o index               use (and update) a sidecar index next to the image\n\n");
+}
+
+int main (int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    MFSFuse fs;
+    int ret = 1;
+    memset(&fs, 0, sizeof fs);
+    memset(&opts, 0, sizeof opts);
+
+    if (fuse_opt_parse(&args, &fs, mfsfuse_opts, mfsfuse_opt_proc) == -1 ||
+        fuse_parse_cmdline(&args, &opts) != 0) goto out;
+    if (opts.show_help) {
+        usage(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto out;
+    }
+    if (opts.show_version) {
+        printf("%s\n", libmfs_id);
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out;
+    }
+    if (fs.image == NULL || opts.mountpoint == NULL) {
+        usage(argv[0]);
+        goto out;
+    }
+
+    // the image is opened before daemonizing changes the working directory
+    fs.vol = mfs_vopen(fs.image, fs.offset, MFS_FOLDERS | (fs.index? MFS_INDEX : 0));
+    if (fs.vol == NULL) {
+        fprintf(stderr, "%s: %s\n", fs.image, strerror(errno));
+        goto out;
+    }
+    if (-1 == mfsfuse_build(&fs)) {
+        fprintf(stderr, "%s: %s\n", fs.image, strerror(errno));
+        goto out;
+    }
+    fs.fd = mfs_vfileno(fs.vol);
+    fs.uid = getuid();
+    fs.gid = getgid();
+
+    if (fuse_opt_add_arg(&args, "-oro,subtype=mfs,default_permissions") == -1) goto out;
+    se = fuse_session_new(&args, &mfsfuse_ops, sizeof mfsfuse_ops, &fs);
+    if (se == NULL) goto out;
+    if (fuse_set_signal_handlers(se) == 0) {
+        if (fuse_session_mount(se, opts.mountpoint) == 0) {
+            fuse_daemonize(opts.foreground);
+            if (opts.singlethread) ret = fuse_session_loop(se);
+            else {
+                struct fuse_loop_config config;
+                memset(&config, 0, sizeof config);
+                config.clone_fd = opts.clone_fd;
+                config.max_idle_threads = opts.max_idle_threads;
+                ret = fuse_session_loop_mt(se, &config);
+            }
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+out:
+    mfsfuse_free(&fs);
+    if (fs.vol) mfs_vclose(fs.vol);
+    free(fs.image);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret? 1 : 0;
+}
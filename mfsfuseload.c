@@ -0,0 +1,351 @@
+/*
+ * mfsfuseload - load test for an MFS volume mounted with mfsfuse
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+// The mount is walked once and checked against the image read with libmfs:
+// every file appears once, with its size. Then each thread lists every
+// directory, stats every entry, looks up names that aren't there, reads every
+// file in pieces of varying size and offset, and reads the Finder info and
+// resource fork xattrs, checking everything against the library.
+
+// getopt, lstat, pread, rand_r, strdup and PATH_MAX aren't in C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+#include "mfs.h"
+
+#define kMFSLoadMaxRead     (128*1024)
+#define kMFSLoadNameMax     (3*255+1)   // UTF-8 file name, or longer than any
+
+// mfsfuse shows '/' in UTF-8 names as DIVISION SLASH
+#define kMFSLoadSlash       "\xE2\x88\x95"
+
+#if defined(__APPLE__)
+#define kMFSLoadXattrPrefix ""
+#define mfsload_getxattr(path, name, buf, size) getxattr(path, name, buf, size, 0, 0)
+#else
+#define kMFSLoadXattrPrefix "user."
+#define mfsload_getxattr(path, name, buf, size) getxattr(path, name, buf, size)
+#endif
+
+struct MFSLoadEntry {
+    char                *path;
+    int                 isDir;
+    size_t              numEntries; // directories, not counting . and ..
+    MFSDirectoryRecord  *rec;       // files that are in the volume
+    int                 mode;       // kMFSForkData or kMFSForkAppleDouble
+    size_t              size;
+    uint8_t             *data;      // expected contents, if rec is set
+    uint8_t             *rsrc;      // expected resource fork xattr
+};
+
+struct MFSLoadThread {
+    pthread_t           thread;
+    int                 num;
+    size_t              ops;
+    size_t              bytes;
+    size_t              errors;
+};
+
+MFSVolume *vol;
+struct MFSLoadEntry *entries;
+size_t numEntries, maxEntries, passes = 10;
+uint8_t *seen;
+
+void usage (const char *prog) {
+    fprintf(stderr, "usage: %s [-o offset] [-t threads] [-n passes] image.img mountpoint\n", prog);
+    exit(1);
+}
+
+double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// UTF-8 name in the volume for a name on the mount
+const char * volume_name (const char *name, char *buf) {
+    char *p = buf;
+    while (*name && p < buf + kMFSLoadNameMax - 1) {
+        if (strncmp(name, kMFSLoadSlash, 3) == 0) {
+            *p++ = '/';
+            name += 3;
+        } else *p++ = *name++;
+    }
+    *p = '\0';
+    return buf;
+}
+
+void * load_fork (MFSDirectoryRecord *rec, int mode, size_t *size) {
+    MFSFork *fk = mfs_fkopen(vol, rec, mode, 0);
+    if (fk == NULL) return NULL;
+    *size = mfs_fksize(fk);
+    uint8_t *data = malloc(*size + 1);
+    if (data && mfs_fkread_at(fk, *size, 0, data) != (int)*size) {
+        free(data);
+        data = NULL;
+    }
+    mfs_fkclose(fk);
+    return data;
+}
+
+struct MFSLoadEntry * add_entry (const char *path, int isDir) {
+    if (numEntries == maxEntries) {
+        maxEntries = maxEntries? 2*maxEntries : 64;
+        struct MFSLoadEntry *e = realloc(entries, maxEntries * sizeof(struct MFSLoadEntry));
+        if (e == NULL) return NULL;
+        entries = e;
+    }
+    struct MFSLoadEntry *e = &entries[numEntries++];
+    memset(e, 0, sizeof *e);
+    e->path = strdup(path);
+    e->isDir = isDir;
+    return e;
+}
+
+// everything under path, and what each file should contain
+int walk (const char *path) {
+    size_t dirEntry = numEntries;
+    if (add_entry(path, 1) == NULL) return -1;
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct dirent *de;
+    int errors = 0;
+    while ((de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        entries[dirEntry].numEntries++;
+        char sub[PATH_MAX];
+        struct stat st;
+        snprintf(sub, sizeof sub, "%s/%s", path, de->d_name);
+        if (-1 == lstat(sub, &st)) {
+            fprintf(stderr, "%s: %s\n", sub, strerror(errno));
+            errors++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (-1 == walk(sub)) errors++;
+            continue;
+        }
+
+        // ._ files of files have their AppleDouble fork, those of folders aren't checked
+        struct MFSLoadEntry *e = add_entry(sub, 0);
+        if (e == NULL) return -1;
+        e->size = st.st_size;
+        int ad = (strncmp(de->d_name, "._", 2) == 0);
+        char name[kMFSLoadNameMax];
+        MFSDirectoryRecord *rec = mfs_directory_lookup_utf8(vol, volume_name(de->d_name + (ad? 2 : 0), name));
+        if (rec == NULL) {
+            if (!ad) {
+                fprintf(stderr, "%s: not in the volume\n", sub);
+                errors++;
+            }
+            continue;
+        }
+        e->rec = rec;
+        e->mode = ad? kMFSForkAppleDouble : kMFSForkData;
+        size_t size;
+        e->data = load_fork(rec, e->mode, &size);
+        if (e->data == NULL || size != e->size) {
+            fprintf(stderr, "%s: size %zu, expected %zu\n", sub, e->size, size);
+            errors++;
+        }
+        if (!ad && rec->flRLgLen && (e->rsrc = load_fork(rec, kMFSForkRsrc, &size)) == NULL) errors++;
+
+        // each file once
+        for(size_t i=0; vol->directory[i]; i++) if (vol->directory[i] == rec) {
+            if (seen[2*i + ad]++) {
+                fprintf(stderr, "%s: seen before\n", sub);
+                errors++;
+            }
+        }
+    }
+    closedir(dir);
+    return errors? -1 : 0;
+}
+
+int check_file (struct MFSLoadThread *t, struct MFSLoadEntry *e, uint8_t *buf, unsigned int *seed, int sequential) {
+    int fd = open(e->path, O_RDONLY);
+    if (fd == -1) return -1;
+    size_t offset = (sequential || e->size == 0)? 0 : rand_r(seed) % e->size;
+    for(size_t done = 0, size; done < e->size; done += size) {
+        size = 1 + rand_r(seed) % kMFSLoadMaxRead;
+        if (offset + size > e->size) size = e->size - offset;
+        ssize_t rb = pread(fd, buf, size, offset);
+        t->ops++;
+        if (rb != (ssize_t)size || (e->data && memcmp(buf, e->data + offset, size))) {
+            close(fd);
+            errno = EIO;
+            return -1;
+        }
+        t->bytes += size;
+        offset = (offset + size < e->size)? offset + size : 0;
+    }
+    return close(fd);
+}
+
+int check_xattrs (struct MFSLoadThread *t, struct MFSLoadEntry *e, uint8_t *buf) {
+    MFSDirectoryRecord *rec = e->rec;
+    uint8_t finfo[32];
+    t->ops++;
+    if (mfsload_getxattr(e->path, kMFSLoadXattrPrefix "com.apple.FinderInfo", finfo, sizeof finfo) != sizeof finfo ||
+        memcmp(finfo, &rec->flUsrWds, 16)) return -1;
+    if (rec->flRLgLen == 0) return 0;
+    t->ops++;
+    if (mfsload_getxattr(e->path, kMFSLoadXattrPrefix "com.apple.ResourceFork", NULL, 0) != rec->flRLgLen) return -1;
+    if (rec->flRLgLen > kMFSLoadMaxRead) return 0;
+    t->ops++;
+    if (mfsload_getxattr(e->path, kMFSLoadXattrPrefix "com.apple.ResourceFork", buf, kMFSLoadMaxRead) != rec->flRLgLen ||
+        memcmp(buf, e->rsrc, rec->flRLgLen)) return -1;
+    t->bytes += rec->flRLgLen;
+    return 0;
+}
+
+void * load_thread (void *arg) {
+    struct MFSLoadThread *t = arg;
+    uint8_t *buf = malloc(kMFSLoadMaxRead);
+    unsigned int seed = t->num + 1;
+    if (buf == NULL) {
+        t->errors++;
+        return NULL;
+    }
+
+    for(size_t pass=0; pass < passes; pass++) {
+        // each thread starts at a different entry, so they overlap in every way
+        for(size_t n=0; n < numEntries; n++) {
+            struct MFSLoadEntry *e = &entries[(n + t->num) % numEntries];
+            struct stat st;
+            int failed = 0;
+            t->ops++;
+            if (-1 == lstat(e->path, &st) || !S_ISDIR(st.st_mode) != !e->isDir || (!e->isDir && st.st_size != (off_t)e->size)) failed = 1;
+            else if (e->isDir) {
+                // listing, and a name that isn't there
+                DIR *dir = opendir(e->path);
+                size_t count = 0;
+                struct dirent *de;
+                if (dir == NULL) failed = 1;
+                else {
+                    while ((de = readdir(dir)))
+                        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) count++;
+                    closedir(dir);
+                    if (count != e->numEntries) failed = 1;
+                }
+                char missing[PATH_MAX];
+                snprintf(missing, sizeof missing, "%s/missing %d.%zu", e->path, t->num, pass);
+                t->ops += 2;
+                if (lstat(missing, &st) != -1 || errno != ENOENT) failed = 1;
+            } else {
+                if (-1 == check_file(t, e, buf, &seed, pass % 2)) failed = 1;
+                else if (e->rec && e->mode == kMFSForkData && -1 == check_xattrs(t, e, buf)) failed = 1;
+            }
+            if (failed) {
+                fprintf(stderr, "%s: check failed (%s)\n", e->path, strerror(errno));
+                t->errors++;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int main (int argc, char *argv[]) {
+    size_t offset = 0;
+    int numThreads = 8, ch;
+    while ((ch = getopt(argc, argv, "o:t:n:")) != -1) {
+        switch (ch) {
+            case 'o':
+                offset = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'n':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || numThreads < 1) usage(argv[0]);
+    const char *image = argv[optind], *mountPoint = argv[optind+1];
+
+    vol = mfs_vopen(image, offset, MFS_FOLDERS);
+    if (vol == NULL) {
+        fprintf(stderr, "%s: %s\n", image, strerror(errno));
+        return 1;
+    }
+    size_t numRecords;
+    for(numRecords = 0; vol->directory[numRecords]; numRecords++);
+    seen = calloc(2*numRecords + 1, 1);
+    if (seen == NULL) return 1;
+
+    // the mount has to match the image before it's worth loading
+    size_t errors = 0;
+    if (-1 == walk(mountPoint)) errors++;
+    for(size_t i=0; i < numRecords; i++) if (!seen[2*i]) {
+        fprintf(stderr, "%s: missing from %s\n", mfs_utf8name(vol->directory[i]), mountPoint);
+        errors++;
+    }
+    if (errors) return 1;
+
+    struct MFSLoadThread *threads = calloc(numThreads, sizeof(struct MFSLoadThread));
+    if (threads == NULL) return 1;
+    double start = now();
+    for(int i=0; i < numThreads; i++) {
+        threads[i].num = i;
+        int err = pthread_create(&threads[i].thread, NULL, load_thread, &threads[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    size_t ops = 0, bytes = 0;
+    for(int i=0; i < numThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+    }
+    double elapsed = now() - start;
+
+    printf("%d threads, %zu entries, %zu operations, %.1f MB in %.3fs: %.0f ops/s, %.1f MB/s, %zu errors\n",
+        numThreads, numEntries, ops, bytes / 1e6, elapsed, ops / elapsed, bytes / 1e6 / elapsed, errors);
+    for(size_t n=0; n < numEntries; n++) {
+        free(entries[n].path);
+        free(entries[n].data);
+        free(entries[n].rsrc);
+    }
+    free(entries);
+    free(threads);
+    free(seen);
+    mfs_vclose(vol);
+    return errors? 1 : 0;
+}